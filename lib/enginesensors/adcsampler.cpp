@@ -0,0 +1,326 @@
+#include "enginesensors.h"
+
+/**
+ * Round robin background ADC sampling.
+ *
+ * Previously every getter did blocking conversions inline, several per reading, and
+ * the same channel was converted by several senders per second. Now every registered
+ * channel is converted in turn in the background into a small ring per channel and
+ * the getters read the average of the ring, which takes a few us.
+ *
+ * On the 3226 the ADC result ready interrupt stores the result, switches the mux to
+ * the next channel and starts the next conversion, so no CPU time is spent waiting
+ * for conversions. Each conversion is a burst accumulated by the ADC in hardware
+ * (see ADC_ACCUMULATE_x), so the interrupt rate is a few hundred Hz and the 16-64
+ * samples per reading cost no CPU time. The accumulated result is decimated to
+ * ADC_FINE_BITS.
+ *
+ * On other MCUs there is no interrupt, poll() converts the next channel and is called
+ * from EngineSensors::read() each loop. The 10 bit reading is scaled to ADC_FINE_BITS.
+ *
+ * A ratiometric pair (see addPair) is converted as a run of single conversions alternating
+ * between the two channels in A B B A order, each started by writing MUXPOS as the first
+ * thing the ISR does. The spacing between conversions is one conversion plus the ISR entry
+ * latency, which varies with interrupt load: the ISR waits behind the flywheel edge
+ * (FREQENCY_METHOD_2), TCA0 overflow and millis interrupts when they are running. The ABBA
+ * order cancels the constant part of the skew, so both channel sums are centred on the same
+ * instant on average, which is what is needed for ripple on a shared supply to cancel in
+ * the ratio. The variable part does not cancel within a pair, it is tens of us against a
+ * ripple period of ms and averages out over the IIR. A single SAR ADC cannot sample both
+ * at the same instant.
+ *
+ * Each new reading is filtered as it is stored, integer only: a median of the last 3
+ * readings rejects single conversion spikes, then a first order IIR with alpha 1/2^n,
+ * n set per channel, smooths. The IIR state is kept as value*2^n so no precision is lost.
+ * With a full cycle of all channels taking ~15ms on the 3226, n=3 gives a time constant
+ * of ~120ms, n=6 ~1s. On other MCUs the update rate, and so the time constant, depends on
+ * the loop rate.
+ *
+ * Buffers are file level, as the ISR needs them.
+ */
+
+volatile uint16_t adcSamples[ADC_SAMPLER_CHANNELS][ADC_SAMPLER_DEPTH];
+volatile uint32_t adcFiltered[ADC_SAMPLER_CHANNELS]; // IIR state, reading*2^adcFilter
+volatile uint8_t adcCurrent = 0;
+volatile uint8_t adcRing = 0;
+volatile uint8_t adcCycles = 0; // saturates at ADC_SAMPLER_DEPTH
+volatile uint16_t adcConversions = 0;
+uint8_t adcPins[ADC_SAMPLER_CHANNELS];
+uint8_t adcMux[ADC_SAMPLER_CHANNELS];
+uint8_t adcAccumulate[ADC_SAMPLER_CHANNELS];
+uint8_t adcSampleDuration[ADC_SAMPLER_CHANNELS];
+uint8_t adcFilter[ADC_SAMPLER_CHANNELS];
+uint8_t adcChannels = 0;
+// Ratiometric pair, the first channel index, the second is the next channel.
+uint8_t adcPairFirst = 0xff;
+uint8_t adcPairSteps = 0;
+volatile uint8_t adcPairStep = 0;
+volatile uint16_t adcPairSum[2];
+
+
+static inline uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+  if ( a > b ) {
+    uint16_t t = a; a = b; b = t;
+  }
+  // a <= b
+  if ( c <= a ) {
+    return a;
+  } else if ( c >= b ) {
+    return b;
+  }
+  return c;
+}
+
+static inline void storeSample(uint16_t reading) {
+  uint8_t ch = adcCurrent;
+  uint8_t filter = adcFilter[ch];
+  adcSamples[ch][adcRing] = reading;
+  if ( adcCycles < 2 ) {
+    // not enough history for the median, seed the filter.
+    adcFiltered[ch] = ((uint32_t)reading)<<filter;
+  } else {
+    uint16_t median = median3(reading,
+      adcSamples[ch][(adcRing-1)&(ADC_SAMPLER_DEPTH-1)],
+      adcSamples[ch][(adcRing-2)&(ADC_SAMPLER_DEPTH-1)]);
+    uint32_t state = adcFiltered[ch];
+    adcFiltered[ch] = state - (state>>filter) + median;
+  }
+  adcConversions++;
+  adcCurrent++;
+  if ( adcCurrent == adcChannels ) {
+    adcCurrent = 0;
+    adcRing = (adcRing+1)&(ADC_SAMPLER_DEPTH-1);
+    if ( adcCycles < ADC_SAMPLER_DEPTH ) {
+      adcCycles++;
+    }
+  }
+}
+
+// 2^accumulate samples have been summed, shift to ADC_FINE_BITS. Max is 4*4095.
+static inline uint16_t decimate(uint32_t sum, uint8_t accumulate, uint8_t bits) {
+  uint8_t fineShift = ADC_FINE_BITS-bits;
+  if ( accumulate >= fineShift ) {
+    return sum >> (accumulate-fineShift);
+  }
+  return sum << (fineShift-accumulate);
+}
+
+// which channel of the pair to convert at a step, A B B A A B B A ...
+static inline uint8_t pairSide(uint8_t step) {
+  return ((step>>1)^step)&0x01;
+}
+
+static inline void storePair(uint8_t bits) {
+  uint8_t accumulate = adcAccumulate[adcCurrent];
+  storeSample(decimate(adcPairSum[0], accumulate, bits));
+  storeSample(decimate(adcPairSum[1], accumulate, bits));
+  adcPairSum[0] = 0;
+  adcPairSum[1] = 0;
+  adcPairStep = 0;
+}
+
+#ifdef __AVR_TINY_2__
+
+static inline void startConversion() {
+  ADC0.CTRLE = adcSampleDuration[adcCurrent];
+  if ( adcCurrent == adcPairFirst ) {
+    // single conversions, each started by the MUXPOS write.
+    ADC0.CTRLF = ADC_SAMPNUM_NONE_gc;
+    ADC0.COMMAND = ADC_MODE_SINGLE_12BIT_gc | ADC_START_MUXPOS_WRITE_gc;
+    ADC0.MUXPOS = adcMux[adcCurrent];
+  } else {
+    ADC0.CTRLF = adcAccumulate[adcCurrent];  // ADC_SAMPNUM_ACCn_gc == log2(n)
+    ADC0.MUXPOS = adcMux[adcCurrent];
+    ADC0.COMMAND = ADC_MODE_BURST_gc | ADC_START_IMMEDIATE_gc;
+  }
+}
+
+ISR(ADC0_RESRDY_vect) {
+  if ( adcCurrent == adcPairFirst ) {
+    uint8_t step = adcPairStep;
+    if ( step+1 < adcPairSteps ) {
+      // start the next conversion of the pair first to keep the skew small,
+      // the result register holds until that conversion completes.
+      ADC0.MUXPOS = adcMux[adcCurrent+pairSide(step+1)];
+      adcPairSum[pairSide(step)] += (uint16_t)ADC0.RESULT;
+      adcPairStep = step+1;
+      return;
+    }
+    adcPairSum[pairSide(step)] += (uint16_t)ADC0.RESULT;
+    storePair(12);
+  } else {
+    // reading the result clears the interrupt flag.
+    storeSample(decimate(ADC0.RESULT, adcAccumulate[adcCurrent], 12));
+  }
+  startConversion();
+}
+
+#endif
+
+
+/**
+ * Register a pin for background sampling, must be called before begin().
+ * filter is n for an IIR alpha of 1/2^n, 0 disables the IIR.
+ * accumulate is log2 of the samples accumulated per conversion, sampleDuration in ADC clocks,
+ * viaPga routes the pin through the PGA at 1x. All are ignored on MCUs without the hardware.
+ */
+bool AdcSampler::addChannel(uint8_t pin, uint8_t filter, uint8_t accumulate, uint8_t sampleDuration, bool viaPga) {
+  if ( findChannel(pin) >= 0 ) {
+    return true;
+  }
+  if ( adcChannels == ADC_SAMPLER_CHANNELS ) {
+    return false;
+  }
+  adcPins[adcChannels] = pin;
+#ifdef __AVR_TINY_2__
+  adcMux[adcChannels] = digitalPinToAnalogInput(pin) | (viaPga?ADC_VIA_PGA_gc:ADC_VIA_ADC_gc);
+#else
+  adcMux[adcChannels] = pin;
+#endif
+  adcAccumulate[adcChannels] = accumulate;
+  adcSampleDuration[adcChannels] = sampleDuration;
+  adcFilter[adcChannels] = filter;
+  adcChannels++;
+  return true;
+}
+
+/**
+ * Register two pins sampled as a ratiometric pair, eg a sensor and its supply, see above.
+ * accumulate is log2 of the samples per pin per reading, between 1 and 4, ie 2-16 samples.
+ * Only one pair is supported.
+ */
+bool AdcSampler::addPair(uint8_t pinA, uint8_t pinB, uint8_t filter, uint8_t accumulate, uint8_t sampleDuration, bool viaPgaA, bool viaPgaB) {
+  if ( adcPairFirst != 0xff || findChannel(pinA) >= 0 || findChannel(pinB) >= 0
+      || adcChannels+2 > ADC_SAMPLER_CHANNELS ) {
+    return false;
+  }
+  if ( accumulate < 1 ) {
+    accumulate = 1;
+  } else if ( accumulate > 4 ) {
+    accumulate = 4; // 16 x 4095 fits the uint16 sums
+  }
+  adcPairFirst = adcChannels;
+  adcPairSteps = 2<<accumulate;
+  addChannel(pinA, filter, accumulate, sampleDuration, viaPgaA);
+  addChannel(pinB, filter, accumulate, sampleDuration, viaPgaB);
+  return true;
+}
+
+/**
+ * Start the background conversions, the adc must already be setup (setupAdc)
+ */
+void AdcSampler::begin() {
+  if ( adcChannels > 0 ) {
+    start();
+  }
+}
+
+void AdcSampler::start() {
+  adcPairSum[0] = 0;
+  adcPairSum[1] = 0;
+  adcPairStep = 0;
+#ifdef __AVR_TINY_2__
+  // PGA at 1x as a buffer, only used by channels routed via the PGA.
+  ADC0.PGACTRL = ADC_GAIN_1X_gc | ADC_PGABIASSEL_1_2X_gc | ADC_PGAEN_bm;
+  ADC0.INTFLAGS = ADC_RESRDY_bm;
+  ADC0.INTCTRL = ADC_RESRDY_bm;
+  startConversion();
+#endif
+}
+
+/**
+ * Convert the next channel on MCUs without the background interrupt.
+ */
+void AdcSampler::poll() {
+#ifndef __AVR_TINY_2__
+  if ( adcChannels == 0 ) {
+    return;
+  }
+  if ( adcCurrent == adcPairFirst ) {
+    // no interrupt, convert the whole pair now.
+    for (uint8_t step = 0; step < adcPairSteps; step++) {
+      adcPairSum[pairSide(step)] += analogRead(adcMux[adcCurrent+pairSide(step)]);
+    }
+    storePair(10);
+  } else {
+    storeSample(decimate(analogRead(adcMux[adcCurrent]), 0, 10));
+  }
+#endif
+}
+
+int8_t AdcSampler::findChannel(uint8_t pin) {
+  for (uint8_t i = 0; i < adcChannels; i++) {
+    if ( adcPins[i] == pin ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Filtered reading of the pin, at ADC_FINE_BITS.
+ * ADC_SAMPLER_NO_DATA if the pin is not registered or not enough conversions have been made.
+ */
+int16_t AdcSampler::readFine(uint8_t pin) {
+  int8_t ch = findChannel(pin);
+  if ( ch < 0 || adcCycles < ADC_SAMPLER_DEPTH ) {
+    return ADC_SAMPLER_NO_DATA;
+  }
+  uint8_t filter = adcFilter[ch];
+  noInterrupts();
+  uint32_t state = adcFiltered[ch];
+  interrupts();
+  if ( filter == 0 ) {
+    return state;
+  }
+  return (state + (1UL<<(filter-1)))>>filter;
+}
+
+/**
+ * As readFine, at the native resolution of the ADC, 12 bits on the 3226, 10 bits otherwise.
+ */
+int16_t AdcSampler::read(uint8_t pin) {
+  int16_t reading = readFine(pin);
+  if ( reading < 0 ) {
+    return reading;
+  }
+#ifdef __AVR_TINY_2__
+  const uint8_t shift = ADC_FINE_BITS-12;
+#else
+  const uint8_t shift = ADC_FINE_BITS-10;
+#endif
+  return (reading + (1<<(shift-1)))>>shift;
+}
+
+/**
+ * Blocking conversion of a pin that is not sampled in the background, eg the stop
+ * solenoid sense, which shares its pin with the led. The background conversions
+ * are suspended for the duration and restarted afterwards.
+ * During a ratiometric pair START holds the MUXPOS write trigger and does not clear
+ * itself, so the trigger is stopped explicitly, then any conversion in progress waited for.
+ */
+int16_t AdcSampler::readDirect(uint8_t pin) {
+#ifdef __AVR_TINY_2__
+  ADC0.INTCTRL = 0;
+  ADC0.COMMAND = (ADC0.COMMAND & ADC_MODE_gm) | ADC_START_STOP_gc;
+  while( (ADC0.STATUS & ADC_ADCBUSY_bm) != 0 ) {};
+  // errors are large negative values, a reading is 0-4095.
+  int32_t result = analogReadEnh(pin, 12);
+  if ( adcChannels > 0 ) {
+    start();
+  }
+  if ( result < 0 ) {
+    return ADC_SAMPLER_NO_DATA;
+  }
+  return (int16_t)result;
+#else
+  return analogRead(pin);
+#endif
+}
+
+uint16_t AdcSampler::getConversions() {
+  noInterrupts();
+  uint16_t conversions = adcConversions;
+  interrupts();
+  return conversions;
+}
@@ -0,0 +1,286 @@
+#include "enginesensors.h"
+
+
+/**
+ * Evaluate all alarms against the snapshot, once per snapshot.
+ * Alarms that depend on engine speed are only evaluated while the engine is running
+ * and not being stopped.
+ */
+void AlarmEvaluator::evaluate(const EngineSnapshot &snapshot) {
+  bool running = snapshot.engineRPM > MIN_ENGINE_RUNNING_RPM && !snapshot.engineStopping;
+  evaluateOilPressure(snapshot, running);
+  evaluateVoltages(snapshot, running);
+  evaluateCoolant(snapshot);
+  evaluateExhaust(snapshot);
+  evaluateOverTemperature(snapshot);
+#ifdef ALTERNATOR_W_TERMINAL
+  // after evaluateVoltages, both may set ENGINE_STATUS1_CHARGE_INDICATOR
+  evaluateRpmSensors(snapshot);
+#endif
+
+  if ( coolantOverTemp || alternatorOverTemp || engineRoomOverTemp ) {
+    SET_BIT(status1, ENGINE_STATUS1_OVERTEMP);
+  } else {
+    CLEAR_BIT(status1, ENGINE_STATUS1_OVERTEMP);
+  }
+  if ( alternatorOverTemp || engineRoomOverTemp ) {
+    SET_BIT(status2, ENGINE_STATUS2_WARN_2);
+  } else {
+    CLEAR_BIT(status2, ENGINE_STATUS2_WARN_2);
+  }
+
+  if ( snapshot.shuttingDown ) {
+    SET_BIT(status2, ENGINE_STATUS2_ENGINE_SUTTING_DOWN);
+  } else {
+    CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_SUTTING_DOWN);
+  }
+  if ( !snapshot.engineRunning && snapshot.engineRPM == 0 ) {
+    CLEAR_BIT(status1, ENGINE_STATUS1_EMERGENCY_STOP);
+  }
+}
+
+/**
+ * Clear all alarms, at the end of the engine start grace period.
+ */
+void AlarmEvaluator::reset() {
+  status1 = 0;
+  status2 = 0;
+  coolantOverTemp = false;
+  alternatorOverTemp = false;
+  engineRoomOverTemp = false;
+  lowOilPressure = false;
+  lowWaterFlow = false;
+#ifdef ALTERNATOR_W_TERMINAL
+  beltSlip = false;
+#endif
+}
+
+void AlarmEvaluator::evaluateOilPressure(const EngineSnapshot &snapshot, bool running) {
+  unsigned long now = snapshot.timestamp;
+  if ( !snapshot.isValid(SNAPSHOT_OIL_PRESSURE) ) {
+    // disconnected or not powered up
+    lowOilPressure = false;
+    CLEAR_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES);
+    if ( running ) {
+      if (delayedTrigger(lowOilPressureStart, LOW_OIL_PRESSURE_WINDOW, now)) {
+        SET_BIT(status2, ENGINE_STATUS2_ENGINE_COMM_ERROR);
+      }
+    } else {
+      lowOilPressureStart = 0;
+      CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_COMM_ERROR);
+    }
+    return;
+  }
+  CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_COMM_ERROR);
+  if (snapshot.value[SENSOR_OIL_PRESSURE] < MIN_OIL_PRESSURE && running) { // 10psi
+    if (delayedTrigger(lowOilPressureStart, LOW_OIL_PRESSURE_WINDOW, now)) {
+      raise(lowOilPressure, EVENT_LOW_OIL_PRES);
+      SET_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES | ENGINE_STATUS1_CHECK_ENGINE);
+      SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED );
+    }
+  } else {
+    lowOilPressureStart = 0;
+    lowOilPressure = false;
+    CLEAR_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES);
+  }
+}
+
+void AlarmEvaluator::evaluateVoltages(const EngineSnapshot &snapshot, bool running) {
+  unsigned long now = snapshot.timestamp;
+  if ( snapshot.isValid(SNAPSHOT_ALTERNATOR_VOLTAGE) ) {
+    if ( snapshot.value[SENSOR_ALTERNATOR_VOLTAGE] < LOW_ALTERNATOR_VOLTAGE && running ) {
+      if (delayedTrigger(lowAlternatorVoltageStart, LOW_ALTERNATOR_VOLTAGE_WINDOW, now)) {
+        SET_BIT(status1, ENGINE_STATUS1_CHARGE_INDICATOR);
+      }
+    } else {
+      lowAlternatorVoltageStart = 0;
+      CLEAR_BIT(status1, ENGINE_STATUS1_CHARGE_INDICATOR);
+    }
+  }
+  if ( snapshot.isValid(SNAPSHOT_ENGINE_BATTERY_VOLTAGE) ) {
+    if ( snapshot.value[SENSOR_ENGINE_BATTERY_VOLTAGE] < LOW_BATTERY_VOLTAGE && running ) {
+      if (delayedTrigger(lowEngineBatteryVStart, LOW_BATTERY_VOLTAGE_WINDOW, now)) {
+        SET_BIT(status1, ENGINE_STATUS1_LOW_SYSTEM_VOLTAGE);
+      }
+    } else {
+      lowEngineBatteryVStart = 0;
+      CLEAR_BIT(status1, ENGINE_STATUS1_LOW_SYSTEM_VOLTAGE);
+    }
+  }
+}
+
+void AlarmEvaluator::evaluateCoolant(const EngineSnapshot &snapshot) {
+  if ( !snapshot.isValid(SNAPSHOT_COOLANT_TEMPERATURE) ) {
+    return;
+  }
+  // 98C, may want to make this a setting ?
+  // the coolant temp has to be measured over temp for > 15s
+  if ( snapshot.value[SENSOR_COOLANT_TEMPERATURE] > MAX_COOLANT_TEMP) {
+    if (delayedTrigger(coolantOverTempStart, ENGINE_OVERTEMP_WINDOW, snapshot.timestamp)) {
+      raise(coolantOverTemp, EVENT_HIGH_COOLANT);
+      SET_BIT(status1, ENGINE_STATUS1_CHECK_ENGINE);
+      SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);
+    }
+  } else {
+    coolantOverTempStart = 0;
+    coolantOverTemp = false;
+  }
+}
+
+/*
+ Raw water flow alarm via the wet exhaust elbow probe.
+
+ The probe is mounted on the silencer body, which is in direct contact
+ with the wet exhaust but thermally isolated from the engine block and
+ heat exchanger. The silencer is therefore heated by exhaust gas and
+ cooled by raw water; coolant temperature is not a useful reference
+ (during a warm restart coolant is at ~85C while the silencer is still
+ near ambient, so any gap-based check has a wide false-positive surface).
+
+ Two independent triggers, gated by engineRunning && alarmsEnabled &&
+ !engineStopping so a hot soak after shutdown or a hot restart cannot
+ raise the alarm:
+   1. Absolute over-temp: temperature > MAX_EXHAUST_TEMP, must persist
+      for HIGH_EXHAUST_WINDOW before EMERGENCY_STOP is asserted (a single
+      noisy ADC sample no longer trips e-stop). WATER_FLOW/CHECK_ENGINE
+      are still set on first sample.
+   2. Rate-of-rise: > EXHAUST_RISE_DELTA in EXHAUST_RISE_WINDOW once the
+      elbow has reached steady state. Catches a flow failure before the
+      absolute threshold (the 21-Jun-2026 incident showed +9C in 30s
+      while still well below 45C).
+*/
+void AlarmEvaluator::evaluateExhaust(const EngineSnapshot &snapshot) {
+  if ( !snapshot.isValid(SNAPSHOT_EXHAUST_TEMPERATURE) ) {
+    return;
+  }
+  int16_t temperature = snapshot.value[SENSOR_EXHAUST_TEMPERATURE];
+  unsigned long now = snapshot.timestamp;
+  bool running = snapshot.engineRunning && snapshot.alarmsEnabled && !snapshot.engineStopping;
+  bool tripped = false;
+
+  if ( running ) {
+    if ( temperature > MAX_EXHAUST_TEMP ) {
+      // First sample over threshold: warn immediately. Hold off on
+      // EMERGENCY_STOP until the condition has persisted.
+      raise(lowWaterFlow, EVENT_EXHAUST_TEMP);
+      SET_BIT(status1, ENGINE_STATUS1_WATER_FLOW | ENGINE_STATUS1_CHECK_ENGINE);
+      SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);
+      if (delayedTrigger(highExhaustStart, HIGH_EXHAUST_WINDOW, now)) {
+        SET_BIT(status1, ENGINE_STATUS1_EMERGENCY_STOP);
+      }
+      tripped = true;
+    } else {
+      highExhaustStart = 0;
+    }
+
+    // Rate-of-rise: only meaningful once the elbow is past warmup. Anchor
+    // the reference once we are above EXHAUST_BASELINE_TEMP, then ratchet
+    // it down so a slow drift does not mask a fast rise but a fast rise
+    // is still detected against the most recent low.
+    if ( temperature >= EXHAUST_BASELINE_TEMP ) {
+      if ( exhaustRiseAnchorTime == 0 || temperature < exhaustRiseAnchor ) {
+        exhaustRiseAnchor = temperature;
+        exhaustRiseAnchorTime = now;
+      } else if ( (now - exhaustRiseAnchorTime) <= EXHAUST_RISE_WINDOW ) {
+        if ( (temperature - exhaustRiseAnchor) >= EXHAUST_RISE_DELTA ) {
+          raise(lowWaterFlow, EVENT_EXHAUST_TEMP);
+          SET_BIT(status1, ENGINE_STATUS1_WATER_FLOW | ENGINE_STATUS1_CHECK_ENGINE);
+          SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);
+          tripped = true;
+        }
+      } else {
+        // Window expired without a trip; re-anchor at current temperature.
+        exhaustRiseAnchor = temperature;
+        exhaustRiseAnchorTime = now;
+      }
+    } else {
+      exhaustRiseAnchorTime = 0;
+    }
+
+  } else {
+    // Engine not running / in grace / stopping: hold off on all triggers
+    // and reset persistence/rate state so a fresh start gets a clean slate.
+    highExhaustStart = 0;
+    exhaustRiseAnchorTime = 0;
+  }
+
+  // Clear only when comfortably below threshold to avoid chatter on a
+  // cooling elbow that sits near the trip point.
+  if ( !tripped && temperature < CLEAR_EXHAUST_TEMP ) {
+    lowWaterFlow = false;
+    CLEAR_BIT(status1, ENGINE_STATUS1_WATER_FLOW);
+  }
+}
+
+/**
+ * Alternator and engine room over temperature, not dependent on engine speed.
+ * Each raises OVERTEMP and WARN_2 with hysteresis, and requests an emergency stop.
+ */
+void AlarmEvaluator::evaluateOverTemperature(const EngineSnapshot &snapshot) {
+  if ( snapshot.isValid(SNAPSHOT_ALTERNATOR_TEMPERATURE) ) {
+    int16_t temperature = snapshot.value[SENSOR_ALTERNATOR_TEMPERATURE];
+    // 110C
+    if ( temperature > MAX_ALTERNATOR_TEMP) {
+      raise(alternatorOverTemp, EVENT_ALTERNATOR_TEMP);
+      SET_BIT(status1, ENGINE_STATUS1_CHECK_ENGINE | ENGINE_STATUS1_EMERGENCY_STOP);
+    } else if ( temperature < CLEAR_ALTERLATOR_TEMP ) {
+      alternatorOverTemp = false;
+    }
+  }
+  if ( snapshot.isValid(SNAPSHOT_ENGINEROOM_TEMPERATURE) ) {
+    int16_t temperature = snapshot.value[SENSOR_ENGINEROOM_TEMPERATURE];
+    // 70C
+    if ( temperature > MAX_ENGINE_ROOM_TEMP) {
+      raise(engineRoomOverTemp, EVENT_ENGINE_ROOM_TEMP);
+      SET_BIT(status1, ENGINE_STATUS1_CHECK_ENGINE | ENGINE_STATUS1_EMERGENCY_STOP);
+    } else if ( temperature < CLEAR_ENGINE_ROOM_TEMP ) {
+      engineRoomOverTemp = false;
+    }
+  }
+}
+
+/**
+ * Set an alarm, saving the event the first time it is raised.
+ */
+void AlarmEvaluator::raise(bool &alarm, uint8_t eventId) {
+  if ( !alarm ) {
+    localStorage.saveEvent(eventId);
+    alarm = true;
+  }
+}
+
+#ifdef ALTERNATOR_W_TERMINAL
+/**
+ * Flywheel and W terminal disagreements, see EngineSensors::crossCheckAlternator.
+ * A failed speed sensor needs checking, the engine speed is still known from the other.
+ * A slipping belt will not charge, so is reported as a charge fault.
+ */
+void AlarmEvaluator::evaluateRpmSensors(const EngineSnapshot &snapshot) {
+  unsigned long now = snapshot.timestamp;
+  if ( (snapshot.rpmSensors & (RPM_SENSOR_FLYWHEEL_FAULT | RPM_SENSOR_ALTERNATOR_FAULT)) != 0 ) {
+    if (delayedTrigger(rpmSensorFaultStart, RPM_SENSOR_FAULT_WINDOW, now)) {
+      SET_BIT(status1, ENGINE_STATUS1_CHECK_ENGINE);
+    }
+  } else {
+    rpmSensorFaultStart = 0;
+  }
+  if ( (snapshot.rpmSensors & RPM_SENSOR_BELT_SLIP) != 0 ) {
+    if (delayedTrigger(beltSlipStart, BELT_SLIP_WINDOW, now)) {
+      raise(beltSlip, EVENT_BELT_SLIP);
+      SET_BIT(status1, ENGINE_STATUS1_CHARGE_INDICATOR);
+      SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);
+    }
+  } else {
+    beltSlipStart = 0;
+    beltSlip = false;
+  }
+}
+#endif
+
+bool AlarmEvaluator::delayedTrigger(unsigned long &start, unsigned long window, unsigned long now) {
+  if (start == 0) {
+    start = now;
+    return false;
+  }
+  return ((now - start) > window);
+}
@@ -65,7 +65,12 @@ void setupTimerFrequencyMeasurement(uint8_t flywheelPin) {
 
 }
 
-void EngineSensors::readEngineRPM(bool outputDebug) {
+uint16_t lastInteruptCount = 0;
+uint16_t lastISRCount = 0;
+uint16_t smoothedFrequency[4]; // 0.1Hz
+uint8_t smoothingSlot = 0;
+
+void readFrequencyCapture(FrequencyCapture &capture, bool outputDebug) {
 
   // copy the capture over, and the interupts, these are volatile.
   noInterrupts();
@@ -76,35 +81,33 @@ void EngineSensors::readEngineRPM(bool outputDebug) {
   //
   uint16_t nInterrupts = interruptCount - lastInteruptCount;
   uint16_t frequency = 0;
-  uint16_t rpm = 0;
   if ( nInterrupts > 10) {
     lastInteruptCount = interruptCount;
     if ( ticks > 4000 ) {
       frequency = 160000000/ticks;
-      rpm = frequency*2;
     }
   }
-  smoothedRPM[(slot++)&0x03] = rpm;
-  float frpm = (float)smoothedRPM[0] 
-    + (float)smoothedRPM[1] 
-    + (float)smoothedRPM[2]
-    + (float)smoothedRPM[3];
-  engineRPM = frpm/40.0;
-  if (fakeEngineRunning) {
-    engineRPM = 1000;
+  smoothedFrequency[(smoothingSlot++)&0x03] = frequency;
+  // average of the last 4 reads, each a single period.
+  uint8_t measured = 0;
+  float f = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    f += (float)smoothedFrequency[i];
+    if ( smoothedFrequency[i] > 0 ) {
+      measured++;
+    }
   }
+  capture.frequency = f/40.0;
+  capture.confidence = measured*25;
+  capture.samples = 4;
+  capture.isrCalls = interruptCount - lastISRCount;
+  lastISRCount = interruptCount;
 
   if ( outputDebug ) {
     Serial.print(F("RPM pulses :"));
     Serial.print(ticks);
     Serial.print(F(" interupts:"));
-    Serial.print(nInterrupts);
-    Serial.print(F(" Hz:"));
-    Serial.print(frequency);
-    Serial.print(F(" Hz:"));
-    Serial.print(nInterrupts*2);
-    Serial.print(F(" RPM:"));
-    Serial.println(engineRPM);    
+    Serial.println(nInterrupts);
   }
 }
 
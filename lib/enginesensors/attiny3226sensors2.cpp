@@ -25,38 +25,63 @@
 // of the input.
 
 volatile uint8_t edges = 0;
-volatile uint8_t slot = 0;
-volatile uint8_t capturedSlot = 0;
-volatile uint16_t capturedCounts[2] = { 0,0 };
-volatile uint16_t capturedOverflows[2] = { 0,0 };
-volatile uint16_t timerISRCalls = 0;
 volatile uint16_t portISRCalls = 0;
+GateCapture flywheelCapture;
+// Edge qualification, see RPM_EDGE_QUALIFY_SHIFT
+volatile uint16_t lastEdgeCount = 0;
+volatile uint16_t minEdgeTicks = 0;
+volatile uint16_t rejectedEdges = 0;
+#ifdef TOOTH_PERIODS
+// TCA0 ticks of each tooth of the last revolution, by tooth, tooth 0 being
+// the first seen after power up.
+volatile uint16_t toothPeriods[FLYWHEEL_TEETH];
+volatile uint8_t tooth = 0;
+volatile uint16_t revolutions = 0;
+#endif
 
 
 
-// Interrupt on edge and capture the counter ever 10 edges.
+// Interrupt on edge and capture the counter every captureEdges edges,
+// adapting captureEdges to keep the capture period near RPM_GATE_TARGET_TICKS.
+// Edges too soon after the last are rejected before they are counted, the expected
+// tooth period comes from the last capture and is cleared by readFrequencyCapture
+// when the gate times out, so the first edges after a stop are not qualified.
+// PC4 is the alternator W terminal, when enabled.
 ISR(PORTC_PORT_vect) {
   uint8_t flags = PORTC.INTFLAGS;
   if ((flags & 0x04) == 0x04) {
     portISRCalls++;
-    edges++;
-    if ( edges == 50 ) {
-      capturedCounts[slot] = TCA0.SINGLE.CNT;
-      capturedOverflows[slot] = timerISRCalls;
-      capturedSlot = slot;
-      slot = (slot+1)&0x01;
-      edges = 0;
+    // 16 bits is exact for teeth shorter than a TCA0 cycle, 262ms.
+    uint16_t edgeCount = TCA0.SINGLE.CNT;
+    uint16_t edgeTicks = edgeCount - lastEdgeCount;
+    if ( edgeTicks < minEdgeTicks ) {
+      rejectedEdges++;
+    } else {
+      lastEdgeCount = edgeCount;
+#ifdef TOOTH_PERIODS
+      toothPeriods[tooth] = edgeTicks;
+      if ( ++tooth == FLYWHEEL_TEETH ) {
+        tooth = 0;
+        revolutions++;
+      }
+#endif
+      edges++;
+      if ( edges >= flywheelCapture.captureEdges ) {
+        uint32_t period = flywheelCapture.capture(captureTimestamp(), edges);
+        uint32_t toothTicks = period/edges;
+        minEdgeTicks = (toothTicks < RPM_EDGE_QUALIFY_MAX_TICKS)?(toothTicks>>RPM_EDGE_QUALIFY_SHIFT):0;
+        edges = 0;
+      }
     }
   }
+#ifdef ALTERNATOR_W_TERMINAL
+  if ((flags & 0x10) == 0x10) {
+    alternatorEdge();
+  }
+#endif
   PORTC.INTFLAGS = flags;
 }
 
-// interupt on overflow.
-ISR(TCA0_OVF_vect) { 
-  timerISRCalls++;
-  TCA0.SINGLE.INTFLAGS  = TCA_SINGLE_OVF_bm; // Always remember to clear the interrupt flags, otherwise the interrupt will fire continually!
-}
-
 
 void setupAdc() {
   analogReference(VDD); // set reference to the desired voltage, and set that as the ADC reference.
@@ -69,17 +94,7 @@ void setupTimerFrequencyMeasurement(uint8_t flywheelPin) {
 
    PORTC.PIN2CTRL |= PORT_ISC_FALLING_gc | PORT_PULLUPEN_bm ; // pullup on the input pin
 
-  // Counter needs to be setup with clock/64 and overflow interrupts running
-  takeOverTCA0();           
-  
-  // 16000000/64 = 250KHz 250000/2^16 =  3.8146972656 overflows/s
-  TCA0.SINGLE.CTRLA = TCA_SINGLE_CLKSEL0_bm | TCA_SINGLE_CLKSEL2_bm; // div 64
-  TCA0.SINGLE.CTRLB = 0x00; // norma, just want the counter, no output.
-  TCA0.SINGLE.CTRLC = 0x00; // nothing to set
-  //TCA0.SINGLE.EVCTRL = 0x00; // disable event actions
-  TCA0.SINGLE.PER = 0xFFFF; // Count all the way up to 0xFFFF
-  TCA0.SINGLE.INTCTRL = TCA_SINGLE_OVF_bm; //enable overflow interrupt
-  TCA0.SINGLE.CTRLA |= TCA_SINGLE_ENABLE_bm; //enable the timer keeping the prescaler.
+  setupCaptureTimebase();
 
 #ifdef WITH_DEBUG
   Serial.println("Frequency measurement 2: Timer A0 setup done");
@@ -89,69 +104,134 @@ void setupTimerFrequencyMeasurement(uint8_t flywheelPin) {
 
 
 
-void EngineSensors::readEngineRPM(bool outputDebug) {
+uint16_t lastISRCalls = 0;
+uint16_t lastRejectedEdges = 0;
+bool flywheelStopped = false;
 
+void readFrequencyCapture(FrequencyCapture &capture, bool outputDebug) {
+#ifdef WITH_DEBUG
+  if ( outputDebug ) {
+    Serial.print(F("RPM edges:"));
+    Serial.print(edges);
+    Serial.print(' ');
+  }
+#endif
+  flywheelCapture.read(capture, outputDebug);
   noInterrupts();
-  uint8_t l = 0, p = 1;
-  if (capturedSlot == 1) {
-    l = 1;
-    p = 0;
+  if ( flywheelCapture.stopped && !flywheelStopped ) {
+    // stopped, the expected tooth period and the partial gate are from the last run.
+    // Once only, a slow restart must be able to fill the gate between reads.
+    minEdgeTicks = 0;
+    edges = 0;
+    lastEdgeCount = TCA0.SINGLE.CNT;
   }
-  uint16_t edgesL = edges;
-  uint16_t ticks = capturedCounts[l] - capturedCounts[p];
-  uint16_t overflows = capturedOverflows[l] - capturedOverflows[p];
+  flywheelStopped = flywheelCapture.stopped;
+  uint16_t isrCalls = portISRCalls + timerISRCalls;
+  uint16_t rejected = rejectedEdges;
   interrupts();
+  capture.isrCalls = isrCalls - lastISRCalls;
+  lastISRCalls = isrCalls;
+  capture.rejected = rejected - lastRejectedEdges;
+  lastRejectedEdges = rejected;
+}
 
-  edgeInterrupts[1] = edgeInterrupts[0];
-  overflowInterrupts[1] = overflowInterrupts[0];
-  edgeInterrupts[0] = portISRCalls;
-  overflowInterrupts[0] = timerISRCalls;
-  uint16_t nEdgeInterrupts = edgeInterrupts[0] - edgeInterrupts[1];
-  uint16_t nOverflowInterrupts = overflowInterrupts[0] - overflowInterrupts[1];
+#ifdef TOOTH_PERIODS
 
+// part/total in 0.01%, shifting both down where part*10000 would overflow.
+static uint16_t basisPoints(uint32_t part, uint32_t total) {
+  while ( part > 0x60000 ) {
+    part >>= 1;
+    total >>= 1;
+  }
+  uint32_t bp = (part*10000)/total;
+  return bp > 0xFFFF ? 0xFFFF : bp;
+}
 
-  double frequency = 0;
-  // ignore noise at over 4KHz (ie 8KRPM) indicated ( ticks > 3000)
-  // and ignore where not enough pulses have been seen (nEdgeInterupts > 150)
-  if ( nEdgeInterrupts > 150 && overflows < 2 && ticks > 3000) {
-    frequency = 50.0*250000.0/(double) ticks;
-#ifdef WITH_DEBUG
-    if ( outputDebug ) {
-      Serial.print(F("valid   "));
-    }
-  } else {
-    if ( outputDebug ) {
-      Serial.print(F("invalid "));
-    }
+/**
+ * Once per revolution, while running, measure the irregularity of the flywheel speed.
+ * roughness is the mean deviation of the tooth periods from the mean period, the crank
+ * acceleration over a revolution, rising when a cylinder delivers less than the others.
+ * imbalance is the largest difference between the two firing halves of the revolution
+ * over all phases, as there is no reference tooth to find TDC. A misfire or a weak
+ * cylinder shows in both. Both are in 0.01% of the revolution period.
+ */
+void EngineSensors::readToothPeriods() {
+  if ( revolutions == lastRevolution ) {
+    return;
   }
-  if ( outputDebug ) {
-    Serial.print(F(" edges:"));
-    Serial.print(edgesL);
-    Serial.print(F(" ticks:"));
-    Serial.print(ticks);      
-#endif
+  uint16_t periods[FLYWHEEL_TEETH];
+  noInterrupts();
+  lastRevolution = revolutions;
+  for (uint8_t i = 0; i < FLYWHEEL_TEETH; i++) {
+    periods[i] = toothPeriods[i];
   }
-  engineRPM = round(frequency*2.0);
-  if (fakeEngineRunning) {
-    engineRPM = 1000;
+  interrupts();
+  if ( !engineRunning ) {
+    return;
   }
 
-#ifdef WITH_DEBUG
-  if ( outputDebug ) {
-    Serial.print(F(" edgeInterrupts:"));
-    Serial.print(nEdgeInterrupts);
-    Serial.print(F(" overflowInterrupts:"));
-    Serial.print(nOverflowInterrupts);
-    Serial.print(F(" overflows:"));
-    Serial.print(overflows);
-    Serial.print(F(" frequency:"));
-    Serial.print(frequency,4);
-    Serial.print(F(" RPM:"));
-    Serial.println(round(frequency*2.0));
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < FLYWHEEL_TEETH; i++) {
+    total += periods[i];
   }
-#endif
+  int32_t mean = total/FLYWHEEL_TEETH;
+  uint32_t deviation = 0;
+  for (uint8_t i = 0; i < FLYWHEEL_TEETH; i++) {
+    int32_t d = (int32_t)periods[i] - mean;
+    deviation += (d < 0)?-d:d;
+    d = (d*1000)/mean;
+    toothProfile[i] = (d > 127)?127:(d < -127)?-127:d;
+  }
+
+  uint32_t firing = 0;
+  for (uint8_t i = 0; i < TEETH_PER_FIRING; i++) {
+    firing += periods[i];
+  }
+  uint32_t imbalance = 0;
+  for (uint8_t i = 0; i < TEETH_PER_FIRING; i++) {
+    uint32_t other = total - firing;
+    uint32_t d = (firing > other)?(firing - other):(other - firing);
+    if ( d > imbalance ) {
+      imbalance = d;
+    }
+    firing += periods[i+TEETH_PER_FIRING];
+    firing -= periods[i];
+  }
+
+  if ( roughnessRevolutions < 255 ) {
+    roughnessSum += basisPoints(deviation, total);
+    imbalanceSum += basisPoints(imbalance, total);
+    roughnessRevolutions++;
+  }
+}
+
+/**
+ * Mean roughness and imbalance since the last call, false if no revolutions
+ * were measured.
+ */
+bool EngineSensors::getRoughness(uint16_t &roughness, uint16_t &imbalance, uint8_t &nRevolutions) {
+  if ( roughnessRevolutions == 0 ) {
+    return false;
+  }
+  roughness = roughnessSum/roughnessRevolutions;
+  imbalance = imbalanceSum/roughnessRevolutions;
+  nRevolutions = roughnessRevolutions;
+  roughnessSum = 0;
+  imbalanceSum = 0;
+  roughnessRevolutions = 0;
+  return true;
+}
 
+void EngineSensors::dumpToothProfile() {
+  Serial.print(F("Tooth profile 0.1%:"));
+  for (uint8_t i = 0; i < FLYWHEEL_TEETH; i++) {
+    Serial.print(' ');
+    Serial.print(toothProfile[i]);
+  }
+  Serial.println();
 }
 
 #endif
-#endif
\ No newline at end of file
+
+#endif
+#endif
@@ -0,0 +1,115 @@
+#include "enginesensors.h"
+
+#ifdef __AVR_TINY_2__
+#ifdef FREQENCY_METHOD_3
+
+/**
+ * As method 2, timing a gate of edges against the free running TCA0 at clk/64,
+ * but the edges are counted in hardware rather than by a port interrupt on every tooth.
+ *
+ * PC2 is routed through the event system and a CCL glitch filter to the count input
+ * of TCB0, which is clocked by the event and runs in periodic interrupt mode with
+ * CCMP = captureEdges-1, so TCB0 interrupts once every captureEdges teeth and resets itself.
+ * The interrupt latches TCA0 and its overflow count, then adapts captureEdges
+ * as method 2 does. At 2000 RPM with 30 teeth thats 20 interrupts/s in place of 1000,
+ * so millis and the OneWire bit timing no longer jitter with engine speed.
+ *
+ * TCB0 is free, millis runs on TCB1 on the 2 series.
+ */
+
+GateCapture flywheelCapture;
+volatile uint16_t captureISRCalls = 0;
+
+
+// Interrupt every captureEdges edges, capture the counter.
+// TCB0 has already restarted from 0, a new CCMP applies to the next capture.
+ISR(TCB0_INT_vect) {
+  captureISRCalls++;
+  flywheelCapture.capture(captureTimestamp(), flywheelCapture.captureEdges);
+  TCB0.CCMP = flywheelCapture.captureEdges-1;
+  TCB0.INTFLAGS = TCB_CAPT_bm;
+}
+
+#ifdef ALTERNATOR_W_TERMINAL
+// The W terminal on PC4 is the only pin interrupt on PORTC with this method.
+ISR(PORTC_PORT_vect) {
+  uint8_t flags = PORTC.INTFLAGS;
+  if ((flags & 0x10) == 0x10) {
+    alternatorEdge();
+  }
+  PORTC.INTFLAGS = flags;
+}
+#endif
+
+
+void setupAdc() {
+  analogReference(VDD); // set reference to the desired voltage, and set that as the ADC reference.
+  delay(100);
+  analogClockSpeed(300); // 300KHz sample rate
+}
+
+void setupTimerFrequencyMeasurement(uint8_t flywheelPin) {
+
+  // Hard coded flywheel pin to PIN_PC2, no pin interrupt.
+  PORTC.PIN2CTRL = PORT_PULLUPEN_bm ; // pullup on the input pin
+
+  setupCaptureTimebase();
+
+  // Wire the pin through the event mechanism on ch5 to CCL LUT0 as a glitch filter, and its
+  // output on ch1 to the B0 count input. The pin event follows the pin level, TCB counts
+  // rising edges of the filtered level, one per tooth.
+  // The LUT passes its event A input through the filter clocked from OSC32K, a level must
+  // be stable for 2 clocks (61us) to pass, so spikes are discarded before they are counted.
+  // At 4000 RPM a tooth is high for 250us. The filter delays every edge by 2-3 clocks, the
+  // jitter of which is spread over the 25-100ms of a gate.
+  // PC2 is not a LUT input pin, and the LUT0 output pin (PA3, SCK) is left disabled.
+  EVSYS.CHANNEL5 = EVSYS_CHANNEL5_PORTC_PIN2_gc;
+  EVSYS.USERCCLLUT0A = EVSYS_USER_CHANNEL5_gc;
+  CCL.CTRLA = 0x0; // LUTs can only be configured while the CCL is disabled.
+  CCL.LUT0CTRLB = CCL_INSEL0_EVENTA_gc | CCL_INSEL1_MASK_gc;
+  CCL.LUT0CTRLC = CCL_INSEL2_MASK_gc;
+  CCL.TRUTH0 = 0x02; // output = IN0
+  CCL.LUT0CTRLA = CCL_CLKSRC_OSC32K_gc | CCL_FILTSEL_FILTER_gc | CCL_ENABLE_bm;
+  CCL.CTRLA = CCL_ENABLE_bm;
+  EVSYS.CHANNEL1 = EVSYS_CHANNEL1_CCL_LUT0_gc;
+  EVSYS.USERTCB0COUNT = EVSYS_USER_CHANNEL1_gc;
+
+  // https://ww1.microchip.com/downloads/en/DeviceDoc/ATtiny3224-3226-3227-Data-Sheet-DS40002345A.pdf
+  // 22.3.3.1.1 Periodic interrupt mode, clocked by the event (CLKSEL EVENT, 2 series only).
+  TCB0.CTRLA = 0x0;
+  TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+  TCB0.EVCTRL = 0x0;
+  TCB0.CNT = 0x0;
+  TCB0.CCMP = flywheelCapture.captureEdges-1; // top, interrupt and reset after captureEdges counts.
+  TCB0.INTFLAGS = TCB_CAPT_bm;
+  TCB0.INTCTRL = TCB_CAPT_bm;
+  TCB0.CTRLA = TCB_CLKSEL_EVENT_gc | TCB_ENABLE_bm;
+
+#ifdef WITH_DEBUG
+  Serial.println("Frequency measurement 3: Timer A0, CCL filter, Timer B0 event counting setup done");
+#endif
+
+}
+
+
+
+uint16_t lastISRCalls = 0;
+
+void readFrequencyCapture(FrequencyCapture &capture, bool outputDebug) {
+#ifdef WITH_DEBUG
+  if ( outputDebug ) {
+    Serial.print(F("RPM edges:"));
+    Serial.print(TCB0.CNT);
+    Serial.print(' ');
+  }
+#endif
+  flywheelCapture.read(capture, outputDebug);
+  noInterrupts();
+  uint16_t isrCalls = captureISRCalls + timerISRCalls;
+  interrupts();
+  capture.isrCalls = isrCalls - lastISRCalls;
+  lastISRCalls = isrCalls;
+}
+
+#endif
+#endif
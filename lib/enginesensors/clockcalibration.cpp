@@ -0,0 +1,52 @@
+#include "enginesensors.h"
+
+#ifdef CLOCK_CALIBRATION
+
+/**
+ * Called with each PGN 126992 received, timeOfDay in 0.0001s since midnight as sent,
+ * localMicros when it was received. Receive latency is the loop time, which averages
+ * out over CLOCK_CALIBRATION_PERIOD, constant send latency cancels.
+ */
+void ClockCalibration::reference(uint8_t source, uint32_t timeOfDay, unsigned long localMicros) {
+  if ( referenceSource == 0xff ) {
+    referenceSource = source;
+    restart(timeOfDay, localMicros);
+    return;
+  }
+  if ( source != referenceSource ) {
+    return;
+  }
+  // local and reference must move forward together, within 5s, or the reference has
+  // stepped, been lost or passed midnight.
+  uint32_t dReference = timeOfDay - lastTime;
+  unsigned long dLocal = localMicros - lastMicros;
+  if ( timeOfDay <= lastTime || dReference > 50000UL || dLocal > 5000000UL ) {
+    restart(timeOfDay, localMicros);
+    return;
+  }
+  lastTime = timeOfDay;
+  lastMicros = localMicros;
+  uint32_t referenceElapsed = timeOfDay - startTime;
+  if ( referenceElapsed >= CLOCK_CALIBRATION_PERIOD*10000UL ) {
+    // a fast CPU counts more than 100 micros per 0.0001s, and under reads frequencies.
+    double measured = (double)(localMicros - startMicros)/(100.0*(double)referenceElapsed);
+    if ( fabs(measured-1.0) < CLOCK_CALIBRATION_LIMIT ) {
+      if ( measurements == 0 ) {
+        correction = measured;
+      } else {
+        correction += (measured-correction)/CLOCK_CALIBRATION_SAMPLES;
+      }
+      measurements++;
+    }
+    restart(timeOfDay, localMicros);
+  }
+}
+
+void ClockCalibration::restart(uint32_t timeOfDay, unsigned long localMicros) {
+  startTime = timeOfDay;
+  lastTime = timeOfDay;
+  startMicros = localMicros;
+  lastMicros = localMicros;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef CURVES_H
+#define CURVES_H
+
+#include "thermistor.h"
+
+/*
+ Sensor curves, generated at compile time from the sensor parameters, see thermistor.h.
+ The spreadsheets these were originally copied from are in enginesensors.cpp.
+*/
+
+// Volvo Penta standard coolant sensor, workshop manual resistances 10C to 120C,
+// 1000R top from the 12V supply, read without a divider against 5V. Readings are
+// scaled to a 12V supply before lookup, so points above 4096 are valid.
+constexpr uint16_t vpCoolantResistances[] = { 1076, 677, 439, 291, 197, 134, 97, 70, 51, 38, 29, 22 };
+constexpr ThermistorCurve vpCoolant = { 0, 0, 0, vpCoolantResistances, 1000, 12.0, 5.0, 100, 100, 12 };
+constexpr CurveTables<12> coolantTables PROGMEM = makeCurveTables<12>(vpCoolant);
+
+// MT52-10K, B=3950, 10K at 25C, 4700R top from Vdd, -20C to 145C.
+constexpr ThermistorCurve mt52_10K = { 3950, 10000, 298.15, NULL, 4700, 5.0, 5.0, -200, 50, 34 };
+constexpr CurveTables<34> NMF5210KTables PROGMEM = makeCurveTables<34>(mt52_10K);
+
+#ifdef NTC_DIRECT_LOOKUP
+// Replaces interpolation of the NTC curve, NTC_DIRECT_LOOKUP_BITS 12 uses 8KB of flash.
+#ifndef NTC_DIRECT_LOOKUP_BITS
+#define NTC_DIRECT_LOOKUP_BITS 12
+#endif
+constexpr CurveLookup<NTC_DIRECT_LOOKUP_BITS> NMF5210KLookup PROGMEM = makeCurveLookup<NTC_DIRECT_LOOKUP_BITS>(mt52_10K);
+#endif
+
+#endif
@@ -4,6 +4,7 @@
 #define PULSE_TIME_METHOD
 // ISR for frequency measurements.
 volatile uint16_t pulseCount = 0;
+volatile uint16_t isrCalls = 0;
 volatile unsigned long lastPulse=0;
 volatile unsigned long thisPulse=0;
 
@@ -14,6 +15,7 @@ volatile unsigned long thisPulse=0;
 
 
 void flywheelPuseHandler() {
+  isrCalls++;
   pulseCount++;
   if ( pulseCount == 100 ) {
     lastPulse = thisPulse;
@@ -23,6 +25,7 @@ void flywheelPuseHandler() {
 }
 
 void flywheelPuseHandler2() {
+  isrCalls++;
   pulseCount++;
 }
 
@@ -46,6 +49,8 @@ void setupTimerFrequencyMeasurement(uint8_t flywheelPin) {
 
 uint16_t countPrev = 0;
 unsigned long timePrev = 0;
+uint16_t isrCallsPrev = 0;
+unsigned long thisPulsePrev = 0;
 
 
 #ifdef PULSE_COUNT_METHOD
@@ -66,7 +71,7 @@ RPM Pulses :1011 Time :1001075 Hz:1009.91 RPM:2019.83
 RPM Pulses :1006 Time :1000967 Hz:1005.03 RPM:2010.06
  * millis and micros both have jitter
  */
-void EngineSensors::readEngineRPM() {
+void readFrequencyCapture(FrequencyCapture &capture, bool outputDebug) {
   uint16_t countNow = pulseCount;
   unsigned long now = micros();
 
@@ -74,21 +79,18 @@ void EngineSensors::readEngineRPM() {
   countPrev = countNow;
   unsigned long time = now - timePrev;
   timePrev = now;
-  // time is in ms
-  double frequency = (double)pulses*1000000.0/(double)time;
-  engineRPM = frequency * 2.0;
-  if (fakeEngineRunning) {
-    engineRPM = 1000;
+  // time is in us
+  capture.frequency = (double)pulses*1000000.0/(double)time;
+  capture.confidence = (pulses > 0)?100:0;
+  capture.samples = pulses;
+  capture.isrCalls = isrCalls - isrCallsPrev;
+  isrCallsPrev += capture.isrCalls;
+  if ( outputDebug ) {
+    Serial.print(F("RPM Pulses :"));
+    Serial.print(pulses);
+    Serial.print(F(" Time :"));
+    Serial.println(time);
   }
-  Serial.print(F("RPM Pulses :"));
-  Serial.print(pulses);
-  Serial.print(F(" Time :"));
-  Serial.print(time);
-  Serial.print(F(" Hz:"));
-  Serial.print(frequency);
-  Serial.print(F(" RPM:"));
-  Serial.println(engineRPM);
-  return engineRPM;
 }
 
 #endif
@@ -140,49 +142,36 @@ Opening CAN
  *
  */
 
-void EngineSensors::readEngineRPM(bool outoutDebug) {
+void readFrequencyCapture(FrequencyCapture &capture, bool outputDebug) {
   noInterrupts();
   unsigned long lastP = lastPulse;
   unsigned long thisP = thisPulse;
+  uint16_t calls = isrCalls;
   interrupts();
 
   unsigned long period = thisP - lastP;
   double frequency = 0;
   // non zero period and update in the last second
   if ( (period > 0) && (micros() - thisP) < 1000000) {
-    // over 10 periods, so multiply top by 10.
+    // over 100 periods, so multiply top by 100.
     frequency = 100000000.0/((double)period);
   }
 
-
-  if ( eepromWritten ) {
-    if ( outoutDebug ) {
-     Serial.print(F("Skip, EEPROM written RPM Period :"));
-    }
-    eepromWritten = false;
-
+  capture.samples = 100;
+  capture.isrCalls = calls - isrCallsPrev;
+  isrCallsPrev = calls;
+  if ( frequency < 200 || frequency > 4000 ) {
+    capture.frequency = 0;
+    capture.confidence = 0;
   } else {
-    if ( frequency < 200 || frequency > 4000 ) {
-      if ( fakeEngineRunning ) {
-        engineRPM = 1000;
-      } else {
-        engineRPM = 0;
-      }
-    } else {
-      engineRPM = 2.0*frequency;
-    }
-  }
-  if (fakeEngineRunning) {
-    engineRPM = 1000;
+    capture.frequency = frequency;
+    capture.confidence = (thisP != thisPulsePrev)?100:50;
   }
+  thisPulsePrev = thisP;
 
-  if ( outoutDebug ) {
+  if ( outputDebug ) {
     Serial.print(F("RPM Period :"));
-    Serial.print(period);
-    Serial.print(F(" Hz:"));
-    Serial.print(frequency);
-    Serial.print(F(" RPM:"));
-    Serial.println(round(engineRPM));
+    Serial.println(period);
   }
 }
 #endif
@@ -1,64 +1,25 @@
 #include "enginesensors.h"
 #include <util/crc16.h>
 #include <SmallNMEA2000.h>
+#include "curves.h"
 
 
 
-#ifdef __AVR_TINY_2__
-
-#define READ_ADC(x) analogReadEnh((x), 12)
+// ADC readings come from the background sampler, which reports ADC_SAMPLER_NO_DATA
+// until it has sampled a channel, or a -ve error code from a direct read.
 #define CHECK_ADC(x) ((x) < 0)
 
-#define ADC_RESOLUTION_SCALE 1
+#ifdef __AVR_TINY_2__
+
 #define RESOLUTION_BITS 4096
 
 #define STOP_SOLENOID_PIN PIN_PC0
 
 #else
 
-#define READ_ADC(x) analogRead((x))
-#define CHECK_ADC(x) false
-#define ADC_RESOLUTION_SCALE 4
 #define RESOLUTION_BITS 1024
 #endif
 
-// common settings.
-// Oil pressure.
-    // 0psi == 0.5v
-    // 100psi = 4.5v
-    // 100ps == 4.5-0.5=4
-    // scale == 100/4 = 25psi/V   
-    // 1psi = 6894.76Pa 
-    // scal in PA == 25*6894.76 = 172369
-    // linear, no divider
-    // 
-#define PSIV_POWEROFF 0.2
-#define PSIV_0 0.5
-#define PSIV_100 4.5
-#define SCALE_TO_PA 172369
-
-    // Rtop = 1000
-    // Rempty = 0
-    // Rfull = 190
-    // diode drop 0.63v
-    // empty = 0v
-    // full = (5-0.63)*190/(190+1000) =  0.697731092436975V
-    // scale  100/0.697731092436975=143.3216909551
-
-#define SCALE_FUEL_TO_PERCENT 143.3216909551
-
-    //(147/47) = 3.1276595745
-#define VOLTAGE_SCALE  3.1276595745
-
-
-
-
-// using 
-
-// same for 
-
-
-
 /*
 
 https://docs.google.com/spreadsheets/d/1cH6MjYFLKQYQMPswFqU3-U8cdn9rH_bujdkhxfRw2cY/edit#gid=1843834819
@@ -105,27 +66,10 @@ C   R   V   ADC ADC 4096    Current (mA)    Power (mW)
 120 22  0.2583170254    53  212 11.74168297 3.03307662
 */
 
-// Thermistor lookups at 4096 resolution, multiply ADC by 4x for 1024 resolution.
-
-const int16_t coolantTable[] PROGMEM= {
-    5095,
-    3969,
-    2999,
-    2216,
-    1618,
-    1162,
-    869,
-    643,
-    477,
-    360,
-    277,
-    212
-};
-#define COOLANT_TABLE_LENGTH 12
-// in 0.1C as interpolation uses ints.
-#define COOLANT_MIN_TEMPERATURE 100
-#define COOLANT_MAX_TEMPERATURE 1200
-#define COOLANT_STEP 100
+// Thermistor lookups at 4096 resolution, generated at compile time in curves.h from the sensor parameters.
+
+// in 0.1C as interpolation uses ints, 10C to 120C.
+const ConversionCurve coolantCurve PROGMEM = { coolantTables.table, coolantTables.reciprocal, coolantTables.index, 100, 100, 12 };
 #define COOLANT_SUPPLY_ADC_12V 3143 // (12*47/147)*4096/5= 3,143.05306122449
 #define COOLANT_SUPPLY_ADC_5V 1310 // (5*47/147)*4096/5=1,309.6054421769
 
@@ -176,47 +120,8 @@ C   K   R   V   ADC 1024    ADC 4096    current (mA)    Power (mW)
 145 418.15  223.2620904 0.2267420323    46  186 1.015586802 0.2302762154
 */
 
-const int16_t tcurveNMF5210K[] PROGMEM= {
-3921,
-3863,
-3790,
-3701,
-3594,
-3467,
-3322,
-3159,
-2979,
-2786,
-2585,
-2378,
-2171,
-1968,
-1773,
-1589,
-1417,
-1259,
-1116,
-987,
-872,
-769,
-679,
-599,
-529,
-468,
-414,
-368,
-326,
-291,
-259,
-231,
-207,
-186
-};
-// in 0.1C steps.
-#define NMF5210K_MIN -200
-#define NMF5210K_MAX 1450
-#define NMF5210K_STEP 50
-#define NMF5210K_LENGTH 34
+// in 0.1C steps, -20C to 145C.
+const ConversionCurve ntcCurveNMF5210K PROGMEM = { NMF5210KTables.table, NMF5210KTables.reciprocal, NMF5210KTables.index, -200, 50, 34 };
 // ADC value that indicates a NTC is not connected.
 #define DISCONNECTED_NTC 4090
 
@@ -224,7 +129,6 @@ const int16_t tcurveNMF5210K[] PROGMEM= {
 
 
 
-extern void setupTimerFrequencyMeasurement(uint8_t flywheelPin);
 extern void setupAdc();
 
 bool EngineSensors::begin() {
@@ -233,21 +137,102 @@ bool EngineSensors::begin() {
   eepromWritten = true;
 
   setupTimerFrequencyMeasurement(flywheelPin);
+#ifdef ENGINE_LOAD_ESTIMATE
+  localStorage.loadFuelUsed();
+#endif
+#ifdef ALTERNATOR_W_TERMINAL
+  localStorage.loadAlternatorRatio();
+  setupAlternatorCapture();
+#endif
 
   setupAdc();
 
+  // ratiometric pairs first, the reference channel is then already registered.
+  SensorChannel channel;
+  for (uint8_t i = 0; i < nChannels; i++) {
+    getChannel(i, channel);
+    if ( channel.reference != SENSOR_NONE ) {
+      SensorChannel reference;
+      for (uint8_t j = 0; j < nChannels; j++) {
+        getChannel(j, reference);
+        if ( reference.id == channel.reference ) {
+          adcSampler.addPair(reference.pin, channel.pin, channel.filter, channel.accumulate, channel.sampleDuration,
+            reference.viaPga, channel.viaPga);
+          break;
+        }
+      }
+    }
+  }
+  for (uint8_t i = 0; i < nChannels; i++) {
+    getChannel(i, channel);
+    adcSampler.addChannel(channel.pin, channel.filter, channel.accumulate, channel.sampleDuration, channel.viaPga);
+  }
+  adcSampler.begin();
+
   return true;
 }
 
 void EngineSensors::read(bool outputDebug) {
+  adcSampler.poll();
+#ifdef TOOTH_PERIODS
+  readToothPeriods();
+#endif
   unsigned long now = millis();
-  if ( now-lastFlywheelReadTime > flywheelReadPeriod) {
+  if ( now-lastFlywheelReadTime >= flywheelReadPeriod) {
+    unsigned long dt = now-lastFlywheelReadTime;
     lastFlywheelReadTime = now;
     readEngineRPM(outputDebug);
+    rpmFilter.update(measuredRPM, 0.001*dt);
+    engineRPM = rpmFilter.rpm;
     updateEngineStatus();
+#ifdef ENGINE_LOAD_ESTIMATE
+    updateFuelUsed(0.001*dt);
+#endif
   }
   checkStop();
   saveEngineHours();
+  if ( now-lastSnapshotTime >= SNAPSHOT_PERIOD ) {
+    lastSnapshotTime = now;
+    updateSnapshot();
+    alarms.evaluate(snapshot);
+    snapshot.status1 = getEngineStatus1();
+    snapshot.status2 = getEngineStatus2();
+  }
+}
+
+/**
+ * Convert all sensors once into the snapshot read by all senders.
+ */
+void EngineSensors::updateSnapshot(bool outputDebug) {
+  snapshot.timestamp = millis();
+  snapshot.engineRPM = engineRPM;
+  snapshot.engineRPMRate = rpmFilter.rate;
+  snapshot.rpmSensors = rpmSensors;
+#ifdef ENGINE_LOAD_ESTIMATE
+  snapshot.engineLoad = loadEstimator.load;
+  snapshot.fuelRate = loadEstimator.fuelRate;
+  snapshot.fuelUsed = 0.001*localStorage.fuelUsedMl;
+#endif
+  snapshot.engineRunning = engineRunning;
+  snapshot.engineStopping = engineStopping;
+  snapshot.shuttingDown = shuttingDown;
+  snapshot.alarmsEnabled = canEmitAlarms;
+  snapshot.engineSeconds = getEngineSeconds();
+
+  uint16_t valid = 0;
+  SensorChannel channel;
+  for (uint8_t i = 0; i < nChannels; i++) {
+    getChannel(i, channel);
+    int32_t value = convert(channel, outputDebug);
+    snapshot.value[channel.id] = value;
+    if ( value != SENSOR_NA ) {
+      valid |= (1<<channel.id);
+    }
+  }
+  snapshot.valid = valid;
+#ifdef ENGINE_LOAD_ESTIMATE
+  checkTank();
+#endif
 }
 
 void EngineSensors::checkStop() {
@@ -255,17 +240,17 @@ void EngineSensors::checkStop() {
   if ( now-lastCheckStop > 100) {
     lastCheckStop = now;
     pinMode(STOP_SOLENOID_PIN, INPUT);
-    int16_t adcReading =  READ_ADC(STOP_SOLENOID_PIN);
+    int16_t adcReading =  adcSampler.readDirect(STOP_SOLENOID_PIN);
     if (adcReading > 3500) {
       if ( !engineStopping ) {
         Serial.print(F("Stopping "));
         Serial.println(millis()-now);
-        SET_BIT(status2, ENGINE_STATUS2_ENGINE_SUTTING_DOWN);
+        shuttingDown = true;
         engineStopping = true;
       }
     } else {
       if ( engineStopping ) {
-        CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_SUTTING_DOWN);
+        shuttingDown = false;
         engineStopping = false;
       }
     }
@@ -307,29 +292,41 @@ void EngineSensors::updateEngineStatus() {
   if ( engineRunning ) {
     if ( engineRPM < ENGINE_SHUTDOWN_RPM ) {
       engineRunning = false;
+      if ( canEmitAlarms ) {
+        stoppedStatus1 = alarms.status1;
+        stoppedStatus2 = alarms.status2;
+      }
       canEmitAlarms = false;
       engineStopping = false;
       Serial.print(F("EngineStop"));
-      SET_BIT(status2, ENGINE_STATUS2_ENGINE_SUTTING_DOWN);
+      shuttingDown = true;
+#ifdef ALTERNATOR_W_TERMINAL
+      localStorage.saveAlternatorRatio();
+      eepromWritten = true;
+#endif
+#ifdef ENGINE_LOAD_ESTIMATE
+      localStorage.saveFuelUsed();
+      eepromWritten = true;
+#endif
     } else if ( !canEmitAlarms && now-engineStarted > ENGINE_START_GRACE_PERIOD ) {
       dumpEngineStatus1();
       dumpEngineStatus2();
-      status1 = 0;
-      status2 = 0;
+      alarms.reset();
       Serial.println(F("EngineStart: Grace period over"));
       canEmitAlarms = true;
     }
   } else {
     if ( engineRPM > 0 ) {
       canEmitAlarms = false;
+      stoppedStatus1 = 0;
+      stoppedStatus2 = 0;
       engineRunning = true;
       engineStopping = false;
       engineStarted = now;
       lastEngineHoursTick = now;
       Serial.println(F("EngineStartup...."));
     } else {
-      CLEAR_BIT(status1, ENGINE_STATUS1_EMERGENCY_STOP);
-      CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_SUTTING_DOWN);
+      shuttingDown = false;
     }
   }
 }
@@ -354,77 +351,180 @@ void EngineSensors::saveEngineHours() {
 
 
 
-double EngineSensors::getEngineRPM() {
-  return engineRPM;
+/**
+ * Measure RPM from the frequency backend, corrected for oscillator drift with CLOCK_CALIBRATION.
+ * EEPROM writes block interrupts which distorts the capture, so the reading
+ * after a write is skipped and the previous measurement held.
+ */
+void EngineSensors::readEngineRPM(bool outputDebug) {
+  readFrequencyCapture(frequencyCapture, outputDebug);
+#ifdef CLOCK_CALIBRATION
+  frequencyCapture.frequency *= clockCalibration.correction;
+#endif
+  if ( eepromWritten ) {
+    eepromWritten = false;
+    if ( outputDebug ) {
+      Serial.println(F("RPM skip, EEPROM written"));
+    }
+    return;
+  }
+  measuredRPM = frequencyCapture.frequency*RPM_FACTOR;
+#ifdef ALTERNATOR_W_TERMINAL
+  crossCheckAlternator(outputDebug);
+#endif
+  if (fakeEngineRunning) {
+    measuredRPM = 1000;
+  }
+  if ( outputDebug ) {
+    Serial.print(F("RPM Hz:"));
+    Serial.print(frequencyCapture.frequency,4);
+    Serial.print(F(" confidence:"));
+    Serial.print(frequencyCapture.confidence);
+    Serial.print(F(" samples:"));
+    Serial.print(frequencyCapture.samples);
+    Serial.print(F(" isr:"));
+    Serial.print(frequencyCapture.isrCalls);
+    Serial.print(F(" rejected:"));
+    Serial.print(frequencyCapture.rejected);
+    Serial.print(F(" RPM:"));
+    Serial.println(measuredRPM);
+  }
 }
 
-
-       
-
-
-double EngineSensors::getFuelCapacity() {
-  return FUEL_CAPACITY;
+#ifdef ENGINE_LOAD_ESTIMATE
+/**
+ * Estimate load and fuel rate, integrating fuel used in whole ml so the total
+ * keeps its resolution, saved every FUEL_SAVE_PERIOD while running and at engine stop.
+ */
+void EngineSensors::updateFuelUsed(double dt) {
+  loadEstimator.update(engineRunning?engineRPM:0, rpmFilter.rate);
+  pendingFuelMl += loadEstimator.fuelRate*dt/3.6;
+  if ( pendingFuelMl >= 1.0 ) {
+    uint32_t ml = (uint32_t)pendingFuelMl;
+    localStorage.fuelUsedMl += ml;
+    pendingFuelMl -= ml;
+  }
+  if ( engineRunning ) {
+    unsigned long now = millis();
+    if ( now-lastFuelSave > FUEL_SAVE_PERIOD ) {
+      lastFuelSave = now;
+      localStorage.saveFuelUsed();
+      eepromWritten = true;
+    }
+  }
 }
- 
-// European Fuel sensor goes 0-190, 190 being full, 0 being empty.
-
-double EngineSensors::getFuelLevel(uint8_t adc, bool outputDebug) { 
-    // probably need a long to do this calc
 
+/**
+ * Cross check the estimated fuel used against the tank level since the last refill.
+ * The reference is only moved while the engine is stopped, when the sender is not sloshing.
+ */
+void EngineSensors::checkTank() {
+  if ( !snapshot.isValid(SNAPSHOT_FUEL_LEVEL) ) {
+    snapshot.tankChecked = false;
+    return;
+  }
+  int16_t level = snapshot.value[SENSOR_FUEL_LEVEL];
+  if ( !engineRunning && (localStorage.tankReferenceLevel < 0 ||
+        level > localStorage.tankReferenceLevel + TANK_REFILL_LEVEL) ) {
+    localStorage.tankReferenceLevel = level;
+    localStorage.tankReferenceMl = localStorage.fuelUsedMl;
+    localStorage.saveFuelUsed();
+    eepromWritten = true;
+  }
+  snapshot.tankChecked = true;
+  snapshot.tankUsed = 0.0001*(localStorage.tankReferenceLevel - level)*getFuelCapacity();
+  snapshot.tankEstimatedUsed = 0.001*(localStorage.fuelUsedMl - localStorage.tankReferenceMl);
+}
+#endif
 
-    // powered by VDD so no can read relative to VDD.
-    int16_t adcReading =  READ_ADC(adc);
-    if ( CHECK_ADC((adcReading))) {
-        if (outputDebug) {
-          Serial.println(F("adc error"));
+#ifdef ALTERNATOR_W_TERMINAL
+/**
+ * Cross check the flywheel against the alternator W terminal, learning the ratio
+ * between them while they agree and the engine is steady.
+ * With no flywheel signal the engine speed comes from the W terminal once the ratio
+ * is known, so engine running, hours and the speed dependent alarms survive either
+ * sensor failing. Disagreements are flagged in rpmSensors, the AlarmEvaluator
+ * decides how long they must persist.
+ */
+void EngineSensors::crossCheckAlternator(bool outputDebug) {
+  readAlternatorCapture(wTerminalCapture, outputDebug);
+#ifdef CLOCK_CALIBRATION
+  wTerminalCapture.frequency *= clockCalibration.correction;
+#endif
+  double ratio = localStorage.alternatorRatio;
+  bool flywheelValid = frequencyCapture.confidence > 0;
+  bool wTerminalValid = wTerminalCapture.confidence > 0;
+  bool steady = fabs(rpmFilter.rate) < RPM_CROSSCHECK_MAX_RATE;
+  rpmSensors = 0;
+  if ( flywheelValid && wTerminalValid ) {
+    double measuredRatio = wTerminalCapture.frequency/frequencyCapture.frequency;
+    if ( ratio == 0 || fabs(measuredRatio-ratio) < ALTERNATOR_RATIO_BAND*ratio ) {
+      if ( steady && measuredRPM > MIN_ENGINE_RUNNING_RPM ) {
+        if ( ratio == 0 ) {
+          ratio = measuredRatio;
+        } else {
+          ratio += (measuredRatio-ratio)/ALTERNATOR_RATIO_SAMPLES;
         }
-        return SNMEA2000::n2kDoubleNA;
-    } 
+        localStorage.alternatorRatio = ratio;
+      }
+    } else if ( steady && measuredRatio < (1.0-RPM_CROSSCHECK_TOLERANCE)*ratio ) {
+      rpmSensors |= RPM_SENSOR_BELT_SLIP;
+    } else if ( steady && measuredRatio > (1.0+RPM_CROSSCHECK_TOLERANCE)*ratio ) {
+      rpmSensors |= RPM_SENSOR_FLYWHEEL_FAULT;
+    }
+  } else if ( flywheelValid ) {
+    // an unlearnt ratio may be an unconnected W terminal.
+    if ( ratio > 0 && measuredRPM > MIN_ENGINE_RUNNING_RPM ) {
+      rpmSensors |= RPM_SENSOR_ALTERNATOR_FAULT;
+    }
+  } else if ( wTerminalValid && ratio > 0 ) {
+    measuredRPM = wTerminalCapture.frequency*RPM_FACTOR/ratio;
+    rpmSensors |= RPM_SENSOR_FLYWHEEL_FAULT | RPM_SENSOR_FROM_ALTERNATOR;
+  }
+  if ( outputDebug ) {
+    Serial.print(F("W Hz:"));
+    Serial.print(wTerminalCapture.frequency,4);
+    Serial.print(F(" confidence:"));
+    Serial.print(wTerminalCapture.confidence);
+    Serial.print(F(" ratio:"));
+    Serial.print(ratio,4);
+    Serial.print(F(" rpmSensors:0x"));
+    Serial.println(rpmSensors,HEX);
+  }
+}
+#endif
 
-    double measuredVoltage = 5.0*((double)adcReading/(double)RESOLUTION_BITS);
-    double fuelReading  = SCALE_FUEL_TO_PERCENT*(double)measuredVoltage;
+double EngineSensors::getEngineRPM() {
+  return engineRPM;
+}
 
 
+       
 
-    if (outputDebug) {
-      Serial.print(F("Fuel tank adc:"));
-      Serial.print(adcReading);
-      Serial.print(F(" v:"));Serial.print(measuredVoltage);
-      Serial.print(F(" %:"));Serial.print(fuelReading);
-      Serial.println("");
-    }    
- 
 
-    // the restances may be out of spec so deal with > 100 or < 0.
-    if ( fuelReading > 200 ) {
-      // sensor disconnected.
-      return SNMEA2000::n2kDoubleNA;
-    } else if (fuelReading > 100 ) {
-      return 100.0;
-    } else if ( fuelReading < 0) {
-      return 0.0;
-    } 
-    return (double)fuelReading;
+double EngineSensors::getFuelCapacity() {
+  return FUEL_CAPACITY;
 }
-
+ 
 uint16_t EngineSensors::getEngineStatus1() {
   if ( canEmitAlarms ) {
-    return status1;
+    return alarms.status1;
   }
-  return 0;
+  return stoppedStatus1;
 }
 
 uint16_t EngineSensors::getEngineStatus2() {
   if ( canEmitAlarms ) {
-    return status2;
+    return alarms.status2;
   }
-  return 0;
+  return stoppedStatus2;
 }
 
 #define checkStatus(s,mask,msg)  if ( ((s)&(mask)) == (mask) ) Serial.print(msg)
 
 void EngineSensors::dumpEngineStatus1() {
   Serial.print(F("Engine Status1: 0x"));
+  uint16_t status1 = alarms.status1;
   Serial.print(status1,HEX);
   checkStatus(status1, ENGINE_STATUS1_CHECK_ENGINE,        F(" engineCheck"));
   checkStatus(status1, ENGINE_STATUS1_OVERTEMP,            F(" overTemp"));
@@ -445,6 +545,7 @@ void EngineSensors::dumpEngineStatus1() {
 }
 void EngineSensors::dumpEngineStatus2() {
   Serial.print(F("Engine Status2: 0x"));
+  uint16_t status2 = alarms.status2;
   Serial.print(status2,HEX);
   checkStatus(status2, ENGINE_STATUS2_WARN_1,                    F(" warn1"));
   checkStatus(status2, ENGINE_STATUS2_WARN_2,                    F(" warn2"));
@@ -459,152 +560,164 @@ void EngineSensors::dumpEngineStatus2() {
 
 
 
-// in Pascal
-double EngineSensors::getOilPressure(uint8_t adc, bool outputDebug) {
-    int16_t adcReading =  READ_ADC(adc);
-    if ( CHECK_ADC((adcReading))) {
-        if (outputDebug) {
-          Serial.println(F("adc error"));
-        }
-        return SNMEA2000::n2kDoubleNA;
-    } 
-    double measuredVoltage = localStorage.vdd*((double)adcReading/(double)RESOLUTION_BITS);
-    double oilPressureReading = (measuredVoltage-PSIV_0)*SCALE_TO_PA;
+void EngineSensors::getChannel(uint8_t i, SensorChannel &channel) {
+  memcpy_P(&channel, &channels[i], sizeof(SensorChannel));
+}
 
-    if (outputDebug) {
-      Serial.print(F("Oil Pressure  "));
-      Serial.print(adcReading);
-      Serial.print(F(" v:"));Serial.print(measuredVoltage);
-      Serial.print(F(" pa:"));Serial.print(oilPressureReading);
-      Serial.print(F(" psi:"));Serial.print(oilPressureReading/6894.76);
-      Serial.println(F(" pa:"));Serial.print(oilPressureReading);      
+uint8_t EngineSensors::findPin(uint8_t id) {
+  SensorChannel channel;
+  for (uint8_t i = 0; i < nChannels; i++) {
+    getChannel(i, channel);
+    if ( channel.id == id ) {
+      return channel.pin;
     }
-    
-
-    // Set oil pressure alarms.
-    if ( oilPressureReading < PSIV_POWEROFF ) {
-      // disconnected or not powered up
-      CLEAR_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES);
-      if ( engineRPM > MIN_ENGINE_RUNNING_RPM && !engineStopping ) {
-        if (delayedTrigger(lowOilPressureStart, LOW_OIL_PRESSURE_WINDOW)) {
-          SET_BIT(status2, ENGINE_STATUS2_ENGINE_COMM_ERROR);
-        }
-      } else {
-        lowOilPressureStart = 0;
-        CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_COMM_ERROR);
-      }
-      return SNMEA2000::n2kDoubleNA;
-    }
-    CLEAR_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES);
-    CLEAR_BIT(status2, ENGINE_STATUS2_ENGINE_COMM_ERROR);
-    // need the real voltage so must scale to take account of VDD.
-    if ( oilPressureReading < 0 ) {
-      oilPressureReading = 0;
-    }
-    if (oilPressureReading < MIN_OIL_PRESSURE && engineRPM > MIN_ENGINE_RUNNING_RPM && !engineStopping) { // 10psi
-      if (delayedTrigger(lowOilPressureStart, LOW_OIL_PRESSURE_WINDOW)) {
-        if ( (status1 & ENGINE_STATUS1_LOW_OIL_PRES) == 0) {
-          localStorage.saveEvent(EVENT_LOW_OIL_PRES);
-        }
-        SET_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES | ENGINE_STATUS1_CHECK_ENGINE);
-        SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED );
-      }
-    } else {
-      lowOilPressureStart = 0;
-      CLEAR_BIT(status1, ENGINE_STATUS1_LOW_OIL_PRES);
-    }
-    return oilPressureReading;
-
+  }
+  return SENSOR_NONE;
 }
 
-
-double EngineSensors::getCoolantTemperatureK(uint8_t coolantAdc, uint8_t batteryAdc, bool outputDebug) {
+/**
+ * Convert a channel to its scaled integer value using the channel descriptor,
+ * SENSOR_NA if not available.
+ */
+int32_t EngineSensors::convert(const SensorChannel &channel, bool outputDebug) {
+  // Fine readings, 16384 == Vdd, to get the 2 extra bits from oversampling.
+  int16_t reading = adcSampler.readFine(channel.pin);
+  if ( CHECK_ADC(reading) ) {
     if (outputDebug) {
-      Serial.print(F("Coolant:"));
+      Serial.print(F("Sensor:"));Serial.print(channel.id);
+      Serial.println(F(" adc error"));
     }
-
-    // Interleave supply and coolant samples and average. The coolant NTC is
-    // powered from raw 12V, so any ripple on the 12V rail must cancel in the
-    // (coolantReading * COOLANT_SUPPLY_ADC_12V / coolantSupply) scaling. A
-    // single supply+coolant pair samples the rail at two different instants,
-    // so ripple does not cancel — it shows up as ±4-5C noise. Averaging N
-    // interleaved pairs makes both readings see (statistically) the same
-    // rail level, and reduces uncorrelated ADC noise by ~sqrt(N).
-    const uint8_t COOLANT_SAMPLES = 8;
-    int32_t supplySum = 0;
-    int32_t coolantSum = 0;
-    for (uint8_t i = 0; i < COOLANT_SAMPLES; i++) {
-      int16_t s = READ_ADC(batteryAdc);
-      int16_t c = READ_ADC(coolantAdc);
-      if ( CHECK_ADC(s) || CHECK_ADC(c) ) {
-        if (outputDebug) {
-          Serial.println(F("adc error"));
-        }
-        return SNMEA2000::n2kDoubleNA;
-      }
-      supplySum += s;
-      coolantSum += c;
+    return SENSOR_NA;
+  }
+  int32_t value;
+  switch(channel.conversion) {
+    case CONVERSION_NTC:
+      value = convertNTC(channel, reading);
+      break;
+    case CONVERSION_RATIOMETRIC_NTC:
+      value = convertRatiometricNTC(channel, reading, outputDebug);
+      break;
+    default:
+      value = convertLinear(channel, reading);
+      break;
+  }
+  if (outputDebug) {
+    Serial.print(F("Sensor:"));Serial.print(channel.id);
+    Serial.print(F(" pin:"));Serial.print(channel.pin);
+    Serial.print(F(" adc:"));Serial.print(reading);
+    Serial.print(F(" value:"));
+    if ( value == SENSOR_NA ) {
+      Serial.println(F("--"));
+    } else {
+      Serial.println(value);
     }
-    int16_t coolantSupply = (supplySum + COOLANT_SAMPLES/2) / COOLANT_SAMPLES;
-    int16_t coolantReading = (coolantSum + COOLANT_SAMPLES/2) / COOLANT_SAMPLES;
-
-    // scale to 4096 bits if not already scaled.
-    coolantReading = coolantReading * ADC_RESOLUTION_SCALE;
-    coolantSupply = coolantSupply * ADC_RESOLUTION_SCALE;
-
-
+  }
+  return value;
+}
 
+// tested ok 20210909
+int32_t EngineSensors::convertNTC(const SensorChannel &channel, int16_t reading) {
+  // The ntcReading is relative to VDD which also supplies the NTC, so no scaling required.
+  if ( reading > (DISCONNECTED_NTC<<ADC_FINE_SHIFT) ) {
+    // NTC disconnected
+    return SENSOR_NA;
+  } 
+#ifdef NTC_DIRECT_LOOKUP
+  // all NTCs are the same part, interpolate the fine bits between lookup entries.
+  const uint8_t shift = ADC_FINE_BITS-NTC_DIRECT_LOOKUP_BITS;
+  uint16_t i = reading>>shift;
+  int16_t t0 = (int16_t)pgm_read_word(&NMF5210KLookup.value[i]);
+  int16_t t1 = (int16_t)pgm_read_word(&NMF5210KLookup.value[i+1]);
+  return t0+(((int32_t)(t1-t0)*(reading&((1<<shift)-1)))>>shift);
+#else
+  return interpolate(reading, channel.curve);
+#endif
+}
 
-    if ( coolantSupply < COOLANT_SUPPLY_ADC_5V) {
+int32_t EngineSensors::convertRatiometricNTC(const SensorChannel &channel, int16_t reading, bool outputDebug) {
+    // The coolant NTC is powered from raw 12V, so any ripple on the 12V rail must
+    // cancel in the (coolantReading * COOLANT_SUPPLY_ADC_12V / coolantSupply) scaling.
+    // A single supply+coolant pair samples the rail at two different instants,
+    // so ripple does not cancel — it shows up as ±4-5C noise. The background sampler
+    // converts the two as a pair, alternating A B B A so both sums are centred on the
+    // same instant and see the same rail level.
+    int16_t supply = adcSampler.readFine(findPin(channel.reference));
+    if ( CHECK_ADC(supply) ) {
+      return SENSOR_NA;
+    }
+    if ( supply < (COOLANT_SUPPLY_ADC_5V<<ADC_FINE_SHIFT)) {
       if (outputDebug) {
         Serial.println(F("no power"));
       } 
-      return SNMEA2000::n2kDoubleNA;
+      return SENSOR_NA;
     }
     // both will be scaled by VDD errors and so those errors cancel out
     // however any difference in the supply (12v) needs to be takne into account.
-    coolantReading = (int16_t)(coolantReading *  ((double)COOLANT_SUPPLY_ADC_12V/(double)coolantSupply) + 0.5);
+    // With a supply just above 5V the scaled reading is up to 2.4x full scale, beyond int16,
+    // saturated it is above the curve and converts to the curve minimum.
+    int32_t scaled = (((int32_t)reading*(COOLANT_SUPPLY_ADC_12V<<ADC_FINE_SHIFT)) + (supply>>1))/supply;
+    reading = (scaled > INT16_MAX)?INT16_MAX:(int16_t)scaled;
 
-    int16_t coolantTemperature = interpolate(coolantReading,COOLANT_MIN_TEMPERATURE, COOLANT_MAX_TEMPERATURE, COOLANT_STEP, coolantTable, COOLANT_TABLE_LENGTH);
+    int16_t temperature = interpolate(reading, channel.curve);
 
     if (outputDebug) {
-      Serial.print(F("Coolant Temperature adc:"));
-      Serial.print(F(" supply scaling:"));Serial.print(((double)COOLANT_SUPPLY_ADC_12V/(double)coolantSupply));
-      Serial.print(F(" cooltantReading:"));Serial.print(coolantReading);
-      Serial.print(F(" 0.1C:"));Serial.print(coolantTemperature);
-      Serial.print(F(" K:"));Serial.println((0.1*coolantTemperature)+273.15);      
+      Serial.print(F("Ratiometric supply:"));Serial.print(supply);
+      Serial.print(F(" reading:"));Serial.print(reading);
+      Serial.print(F(" 0.1C:"));Serial.println(temperature);
     }
+    return temperature; 
+}
 
-    // 98C, may want to make this a setting ?
-    // the coolant temp has to be measured over temp for > 15s
+int32_t EngineSensors::convertLinear(const SensorChannel &channel, int16_t reading) {
+  uint16_t supplyMv = (channel.conversion == CONVERSION_LINEAR_5V)?5000:localStorage.vddMv;
+  int16_t mV = ((int32_t)reading*supplyMv)>>ADC_FINE_BITS;
+  if ( mV < channel.minMv ) {
+    // disconnected or not powered up
+    return SENSOR_NA;
+  }
+  int32_t value = ((int32_t)(mV-channel.offset)*channel.scale)>>channel.shift;
+  // the sensor may be out of spec so deal with > limit or < 0.
+  if ( value > channel.maxValue ) {
+    // sensor disconnected.
+    return SENSOR_NA;
+  } else if ( value > channel.limit ) {
+    return channel.limit;
+  } else if ( value < 0 ) {
+    return 0;
+  }
+  return value;
+}
 
-    if ( coolantTemperature > MAX_COOLANT_TEMP) {
-      if (delayedTrigger(coolantOverTempStart, ENGINE_OVERTEMP_WINDOW)) {
-        if ( (status1 & ENGINE_STATUS1_OVERTEMP) == 0) {
-          localStorage.saveEvent(EVENT_HIGH_COOLANT);
-        }
+double EngineSnapshot::getTemperatureK(uint8_t id) const {
+  if ( !isValid(1<<id) ) {
+    return SNMEA2000::n2kDoubleNA;
+  }
+  return (0.1*value[id])+273.15;
+}
 
-        SET_BIT(status1, ENGINE_STATUS1_OVERTEMP | ENGINE_STATUS1_CHECK_ENGINE);
-        SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);        
-      }
-    } else {
-      coolantOverTempStart = 0;
-      CLEAR_BIT(status1, ENGINE_STATUS1_OVERTEMP);
-    }
-    return (0.1*coolantTemperature)+273.15; 
+double EngineSnapshot::getVoltage(uint8_t id) const {
+  if ( !isValid(1<<id) ) {
+    return SNMEA2000::n2kDoubleNA;
+  }
+  return 0.001*value[id];
+}
 
+double EngineSnapshot::getPressure(uint8_t id) const {
+  if ( !isValid(1<<id) ) {
+    return SNMEA2000::n2kDoubleNA;
+  }
+  return value[id];
 }
 
-bool EngineSensors::delayedTrigger(unsigned long &start, unsigned long window) {
-  if (start == 0) {
-    start = millis();
-    return false;    
+double EngineSnapshot::getPercent(uint8_t id) const {
+  if ( !isValid(1<<id) ) {
+    return SNMEA2000::n2kDoubleNA;
   }
-  return ((millis() - start) > window);  
+  return 0.01*value[id];
 }
 
 void EngineSensors::dumpADC(uint8_t adc) { 
-  int16_t adcReading =  READ_ADC(adc);
+  int16_t adcReading =  adcSampler.read(adc);
   if ( CHECK_ADC((adcReading))) {
       Serial.print(F("adc:"));
       Serial.print(adc);
@@ -627,233 +740,12 @@ void EngineSensors::dumpADC(uint8_t adc) {
   Serial.println(voltage, 5);
 }
 
-int16_t EngineSensors::readAdcSampled(uint8_t adc) {
-  const uint8_t SAMPLES = 8;
-  int32_t adcSum = 0;
-  for (uint8_t i = 0; i < SAMPLES; i++) {
-    int16_t s = READ_ADC(adc);
-    if ( CHECK_ADC(s)) {
-      return s;
-    }
-    adcSum += s;
-  }
-  return (adcSum + SAMPLES/2) / SAMPLES;
-}
-
-
-double EngineSensors::getVoltage(uint8_t adc, bool outputDebug) { 
-
-  // voltages can be noisy to sample.
-  int16_t adcReading =  readAdcSampled(adc);
-  if ( CHECK_ADC((adcReading))) {
-      if (outputDebug) {
-        Serial.println(F("adc error"));
-      } 
-      return SNMEA2000::n2kDoubleNA;
-  } 
-
-  double voltage = (double)VOLTAGE_SCALE*localStorage.vdd*((double)adcReading/(double)RESOLUTION_BITS);
-  if (outputDebug) {
-    Serial.print(F("Voltage n:"));
-    Serial.print(adc);
-    Serial.print(F(" adc:"));Serial.print(adcReading);
-    Serial.print(F(" V:"));Serial.println(voltage);    
-  }
-  if ( adc == adcAlternatorVoltage ) {
-    if ( voltage < LOW_ALTERNATOR_VOLTAGE && engineRPM > MIN_ENGINE_RUNNING_RPM  && !engineStopping ) {
-      if (delayedTrigger(lowAlternatorVoltageStart, LOW_ALTERNATOR_VOLTAGE_WINDOW)) {
-        SET_BIT(status1, ENGINE_STATUS1_CHARGE_INDICATOR);
-      }
-    } else {
-      lowAlternatorVoltageStart = 0;
-      CLEAR_BIT(status1, ENGINE_STATUS1_CHARGE_INDICATOR);
-    }
-  } else if ( adc == adcEngineBattery) {
-    if ( voltage < LOW_BATTERY_VOLTAGE && engineRPM > MIN_ENGINE_RUNNING_RPM && !engineStopping) {
-      if (delayedTrigger(lowEngineBatteryVStart, LOW_BATTERY_VOLTAGE_WINDOW)) {
-        SET_BIT(status1, ENGINE_STATUS1_LOW_SYSTEM_VOLTAGE);
-      }
-    } else {
-      lowEngineBatteryVStart = 0;
-      CLEAR_BIT(status1, ENGINE_STATUS1_LOW_SYSTEM_VOLTAGE);
-    }
-  }
-  return voltage; 
-};
-
-
-// tested ok 20210909
-double EngineSensors::getTemperatureK(uint8_t adc, bool outputDebug) {
-  // probably need a long to do this calc
-
-
-  // The ntcReading is relative to VDD which also supplies the NTC, so no scaling required.
-  int16_t ntcReading =  READ_ADC(adc);
-  if ( CHECK_ADC((ntcReading))) {
-      if (outputDebug) {
-        Serial.println(F("adc error"));
-      } 
-      return SNMEA2000::n2kDoubleNA;
-  } 
-
-  // scale to 4096 bits if not already scaled.
-  ntcReading = ntcReading * ADC_RESOLUTION_SCALE;
-  
-
-  if ( ntcReading > DISCONNECTED_NTC ) {
-    if (outputDebug) {
-      Serial.println("NTC disconnected");
-    }
-    return SNMEA2000::n2kDoubleNA;
-  } 
-
-  int16_t temperature = interpolate(ntcReading, NMF5210K_MIN, NMF5210K_MAX, NMF5210K_STEP, tcurveNMF5210K, NMF5210K_LENGTH);
-
-  if (outputDebug) {
-    Serial.print(F("Temperature adcn:"));
-    Serial.print(adc);
-    Serial.print(F(" adc:"));Serial.print(ntcReading);
-    Serial.print(F(" 0.1C:"));Serial.print(temperature);
-    Serial.print(F(" K:"));Serial.println((0.1*temperature)+273.15);    
-  }
-
-  // temperatures are in 0.1C
-  // Raw water flow alarm via the wet exhaust elbow probe.
-  //
-  // The probe is mounted on the silencer body, which is in direct contact
-  // with the wet exhaust but thermally isolated from the engine block and
-  // heat exchanger. The silencer is therefore heated by exhaust gas and
-  // cooled by raw water; coolant temperature is not a useful reference
-  // (during a warm restart coolant is at ~85C while the silencer is still
-  // near ambient, so any gap-based check has a wide false-positive surface).
-  //
-  // Two independent triggers, gated by engineRunning && canEmitAlarms &&
-  // !engineStopping so a hot soak after shutdown or a hot restart cannot
-  // raise the alarm:
-  //   1. Absolute over-temp: temperature > MAX_EXHAUST_TEMP, must persist
-  //      for HIGH_EXHAUST_WINDOW before EMERGENCY_STOP is asserted (a single
-  //      noisy ADC sample no longer trips e-stop). WATER_FLOW/CHECK_ENGINE
-  //      are still set on first sample.
-  //   2. Rate-of-rise: > EXHAUST_RISE_DELTA in EXHAUST_RISE_WINDOW once the
-  //      elbow has reached steady state. Catches a flow failure before the
-  //      absolute threshold (the 21-Jun-2026 incident showed +9C in 30s
-  //      while still well below 45C).
-  if ( adc == adcExhaustNTC1 ) {
-    bool running = engineRunning && canEmitAlarms && !engineStopping;
-    bool tripped = false;
-
-    if ( running ) {
-      if ( temperature > MAX_EXHAUST_TEMP ) {
-        // First sample over threshold: warn immediately. Hold off on
-        // EMERGENCY_STOP until the condition has persisted.
-        if ( (status1 & ENGINE_STATUS1_WATER_FLOW) == 0) {
-          localStorage.saveEvent(EVENT_EXHAUST_TEMP);
-        }
-        SET_BIT(status1, ENGINE_STATUS1_WATER_FLOW | ENGINE_STATUS1_CHECK_ENGINE);
-        SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);
-        if (delayedTrigger(highExhaustStart, HIGH_EXHAUST_WINDOW)) {
-          SET_BIT(status1, ENGINE_STATUS1_EMERGENCY_STOP);
-        }
-        tripped = true;
-      } else {
-        highExhaustStart = 0;
-      }
-
-      // Rate-of-rise: only meaningful once the elbow is past warmup. Anchor
-      // the reference once we are above EXHAUST_BASELINE_TEMP, then ratchet
-      // it down so a slow drift does not mask a fast rise but a fast rise
-      // is still detected against the most recent low.
-      if ( temperature >= EXHAUST_BASELINE_TEMP ) {
-        unsigned long now = millis();
-        if ( exhaustRiseAnchorTime == 0 || temperature < exhaustRiseAnchor ) {
-          exhaustRiseAnchor = temperature;
-          exhaustRiseAnchorTime = now;
-        } else if ( (now - exhaustRiseAnchorTime) <= EXHAUST_RISE_WINDOW ) {
-          if ( (temperature - exhaustRiseAnchor) >= EXHAUST_RISE_DELTA ) {
-            if ( (status1 & ENGINE_STATUS1_WATER_FLOW) == 0) {
-              localStorage.saveEvent(EVENT_EXHAUST_TEMP);
-            }
-            SET_BIT(status1, ENGINE_STATUS1_WATER_FLOW | ENGINE_STATUS1_CHECK_ENGINE);
-            SET_BIT(status2, ENGINE_STATUS2_MAINTANENCE_NEEDED);
-            tripped = true;
-          }
-        } else {
-          // Window expired without a trip; re-anchor at current temperature.
-          exhaustRiseAnchor = temperature;
-          exhaustRiseAnchorTime = now;
-        }
-      } else {
-        exhaustRiseAnchorTime = 0;
-      }
-
-    } else {
-      // Engine not running / in grace / stopping: hold off on all triggers
-      // and reset persistence/rate state so a fresh start gets a clean slate.
-      highExhaustStart = 0;
-      exhaustRiseAnchorTime = 0;
-    }
-
-    // Clear only when comfortably below threshold to avoid chatter on a
-    // cooling elbow that sits near the trip point.
-    if ( !tripped && temperature < CLEAR_EXHAUST_TEMP ) {
-      CLEAR_BIT(status1, ENGINE_STATUS1_WATER_FLOW);
-    }
-  } else if ( adcAlternatorNTC2) {
-    // 100C
-    if ( temperature > MAX_ALTERNATOR_TEMP) {
-      if ( (status1 & ENGINE_STATUS1_OVERTEMP) == 0) {
-        localStorage.saveEvent(EVENT_ALTERNATOR_TEMP);
-      }
-      SET_BIT(status1, ENGINE_STATUS1_OVERTEMP | ENGINE_STATUS1_CHECK_ENGINE | ENGINE_STATUS1_EMERGENCY_STOP);
-      SET_BIT(status1, ENGINE_STATUS2_WARN_2);
-    } else if ( temperature < CLEAR_ALTERLATOR_TEMP ) {
-      CLEAR_BIT(status1, ENGINE_STATUS2_WARN_2);
-    }
-  } else if ( adcEngineRoomNTC3 ) {
-    // 70C
-    if ( temperature > MAX_ENGINE_ROOM_TEMP) {
-      if ( (status1 & ENGINE_STATUS1_OVERTEMP) == 0) {
-        localStorage.saveEvent(EVENT_ENGINE_ROOM_TEMP);
-      }
-      SET_BIT(status1, ENGINE_STATUS1_OVERTEMP | ENGINE_STATUS1_CHECK_ENGINE | ENGINE_STATUS1_EMERGENCY_STOP);
-      SET_BIT(status1, ENGINE_STATUS2_WARN_2);
-    } else if ( temperature < CLEAR_ENGINE_ROOM_TEMP ) {
-      CLEAR_BIT(status1, ENGINE_STATUS2_WARN_2);
-    }
-  }
-  return (0.1*temperature)+273.15;
-}
-
-
-
-
-/**
- *  convert a reading from a ntc into a temperature using a curve.
- */ 
-// tested ok 20210909
-int16_t EngineSensors::interpolate(
-      int16_t reading, 
-      int16_t minCurveValue, 
-      int16_t maxCurveValue,
-      int step, 
-      const int16_t *curve, 
-      int curveLength
-      ) {
-  int16_t cvp = (int16_t)pgm_read_word(&curve[0]);
-  if ( reading > cvp ) {
-    return minCurveValue;
+void EngineSensors::dumpADCs() {
+  SensorChannel channel;
+  for (uint8_t i = 0; i < nChannels; i++) {
+    getChannel(i, channel);
+    Serial.print(F("Sensor "));Serial.print(channel.id);Serial.print(F(" : "));
+    dumpADC(channel.pin);
   }
-  for (int i = 1; i < curveLength; i++) {
-    int16_t cv = (int16_t)pgm_read_word(&curve[i]);
-    if ( reading > cv ) {
-      return minCurveValue+((i-1)*step)+((cvp-reading)*step)/(cvp-cv);
-    }
-    cvp = cv;
-  }
-  return maxCurveValue;
 }
 
-
-
-
-
@@ -5,7 +5,16 @@
 
 
 // read frequencies
-#define DEFAULT_FLYWHEEL_READ_PERIOD 500
+// RPM is measured and filtered at this period, 10Hz for PGN 127488.
+#define DEFAULT_FLYWHEEL_READ_PERIOD 100
+// Latency/jitter trade-off of the RPM filter, 0 to 0.95. 0 passes the measurement through,
+// higher values smooth more and follow changes more slowly. At 0.5 and 100ms a step
+// settles within 1% in about 0.8s, at 0.8 in about 2.4s.
+#ifndef RPM_FILTER_THETA
+#define RPM_FILTER_THETA 0.5
+#endif
+// All sensors are converted into the EngineSnapshot at this period.
+#define SNAPSHOT_PERIOD 100
 
 // Engine hours resolution
 #define ENGINE_HOURS_PERIOD_MS 15000
@@ -28,7 +37,10 @@
 #define EXHAUST_RISE_WINDOW 30000UL
 // Exhaust over-temp must persist for this long before EMERGENCY_STOP is
 // asserted. WATER_FLOW/CHECK_ENGINE are still set on first sample.
-#define HIGH_EXHAUST_WINDOW 5000
+// Readings are median+IIR filtered (see ADC_FILTER_NTC) so a single noisy
+// conversion cannot reach the threshold, the window only needs to cover real
+// short excursions.
+#define HIGH_EXHAUST_WINDOW 2000
 #define MAX_ALTERNATOR_TEMP 1100
 #define CLEAR_ALTERLATOR_TEMP 500
 #define MAX_ENGINE_ROOM_TEMP 700
@@ -39,7 +51,7 @@
 // Volrages and pressure must be low for > 5s to trigger an alarm.
 #define LOW_ALTERNATOR_VOLTAGE_WINDOW 5000
 #define LOW_BATTERY_VOLTAGE_WINDOW 5000
-#define LOW_OIL_PRESSURE_WINDOW 5000
+#define LOW_OIL_PRESSURE_WINDOW 2000 // filtered, see ADC_FILTER_OIL
 
 
 // speed below which the engine is not running 
@@ -49,11 +61,30 @@
 // below this the engine is shutting down
 #define ENGINE_SHUTDOWN_RPM 500
 
+// Alternator W terminal cross-check, ALTERNATOR_W_TERMINAL.
+// The W terminal to flywheel frequency ratio (pulley ratio * pole pairs / 30 teeth) is learnt
+// while both are measured and the engine is running steadily. Only ratios within
+// ALTERNATOR_RATIO_BAND of the learnt ratio are averaged in, so belt slip is not calibrated out.
+#define ALTERNATOR_RATIO_BAND 0.02
+#define ALTERNATOR_RATIO_SAMPLES 100.0 // running average, 10s at 10Hz
+// Readings are only compared when steady, the two gates are not taken at the same time.
+#define RPM_CROSSCHECK_MAX_RATE 100.0 // RPM/s
+// W terminal slower than the flywheel by more than this is belt slip, faster is missing flywheel teeth.
+#define RPM_CROSSCHECK_TOLERANCE 0.05
+#define BELT_SLIP_WINDOW 10000
+#define RPM_SENSOR_FAULT_WINDOW 5000
+
+// EngineSnapshot rpmSensors bits, from the ALTERNATOR_W_TERMINAL cross-check.
+#define RPM_SENSOR_FLYWHEEL_FAULT 0x01    // no flywheel signal with the W terminal running, or too few teeth.
+#define RPM_SENSOR_ALTERNATOR_FAULT 0x02  // no W terminal signal with the engine running.
+#define RPM_SENSOR_BELT_SLIP 0x04
+#define RPM_SENSOR_FROM_ALTERNATOR 0x08   // engineRPM measured from the W terminal.
+
 
 // alarm levels dependent on engine speed.
-#define LOW_ALTERNATOR_VOLTAGE 12.2
-#define LOW_BATTERY_VOLTAGE 11.8
-#define MIN_OIL_PRESSURE 68940.0  // 10psi
+#define LOW_ALTERNATOR_VOLTAGE 12200 // mV
+#define LOW_BATTERY_VOLTAGE 11800  // mV
+#define MIN_OIL_PRESSURE 68940  // Pa, 10psi
 
 
 
@@ -97,6 +128,34 @@
 #define FUEL_SENSOR_MAX 190
 #define FUEL_CAPACITY 60
 
+// Oil pressure.
+    // 0psi == 0.5v
+    // 100psi = 4.5v
+    // 100ps == 4.5-0.5=4
+    // scale == 100/4 = 25psi/V   
+    // 1psi = 6894.76Pa 
+    // scal in PA == 25*6894.76 = 172369
+    // linear, no divider
+    // 
+#define PSIV_POWEROFF 0.2
+#define PSIV_0 0.5
+#define PSIV_100 4.5
+#define SCALE_TO_PA 172369
+
+// European Fuel sensor goes 0-190, 190 being full, 0 being empty.
+    // Rtop = 1000
+    // Rempty = 0
+    // Rfull = 190
+    // diode drop 0.63v
+    // empty = 0v
+    // full = (5-0.63)*190/(190+1000) =  0.697731092436975V
+    // scale  100/0.697731092436975=143.3216909551
+
+#define SCALE_FUEL_TO_PERCENT 143.3216909551
+
+    //(147/47) = 3.1276595745
+#define VOLTAGE_SCALE  3.1276595745
+
 
 // pulses  Perms -> RPM conversion.
 // 415Hz at idle below needs adjusting.//
@@ -106,6 +165,150 @@
 // There could be a factor to apply to account for any clock frequency errors.
 #define RPM_FACTOR 2.0 
 
+/**
+ * A reading of the flywheel frequency from the backend selected by FREQENCY_METHOD_x,
+ * each backend implements setupTimerFrequencyMeasurement and readFrequencyCapture.
+ * The ISRs are bound at compile time so only one backend is built, tools/frequency_sim.py
+ * compares them against the same synthetic pulse trains.
+ */
+struct FrequencyCapture {
+    double frequency = 0;    // Hz at the flywheel pickup, 0 when not measurable
+    uint8_t confidence = 0;  // 0 not measurable, 50 previous measurement reused, 100 new measurement
+    uint16_t samples = 0;    // edges the measurement covers
+    uint16_t isrCalls = 0;   // interrupts taken since the last read, the CPU cost of the backend
+    uint16_t rejected = 0;   // edges discarded as noise since the last read, where the backend sees them
+};
+
+void setupTimerFrequencyMeasurement(uint8_t flywheelPin);
+void readFrequencyCapture(FrequencyCapture &capture, bool outputDebug);
+
+// Adaptive capture gate for the ATtiny3226 frequency methods.
+// The number of edges per capture doubles or halves so a capture takes 25-100ms of
+// TCA0 at 250KHz, keeping the update rate near 50ms from cranking (~150 RPM, 2 edges)
+// to over 4000 RPM (128 edges).
+#define RPM_GATE_TARGET_TICKS 12500 // 50ms
+#define RPM_GATE_MIN_EDGES 2
+#define RPM_GATE_MAX_EDGES 128
+#define RPM_GATE_INITIAL_EDGES 16
+
+// A capture period longer than this, 1s, spans a stop and is not a reading.
+// It is also how long the last capture is reported, at confidence 50, after the edges stop,
+// so a reading below ~4 RPM (RPM_GATE_MIN_EDGES teeth in 1s) is still a reading. This is
+// intended: a real stop runs down through ENGINE_SHUTDOWN_RPM while edges still arrive, so the
+// reading held is already low. Only an instant stop, as in tools/frequency_sim.py, holds the
+// running RPM for up to 1s.
+#define RPM_GATE_MAX_TICKS 250000UL
+
+// Edge qualification, FREQENCY_METHOD_2. An edge sooner than the expected tooth period >> this
+// after the last accepted edge is noise, ringing or a spike from the comparator, and is not counted.
+// At 1 (half a tooth) a spike replaces at most one tooth, leaving the count right, and the
+// firing pulsation while cranking stays well clear.
+#ifndef RPM_EDGE_QUALIFY_SHIFT
+#define RPM_EDGE_QUALIFY_SHIFT 1
+#endif
+// Expected tooth periods above this, ~60 RPM, are not qualified, TCA0 is only 16 bits per edge.
+#define RPM_EDGE_QUALIFY_MAX_TICKS 0x4000
+
+// Per tooth periods with TOOTH_PERIODS, only FREQENCY_METHOD_2 sees every tooth.
+#define FLYWHEEL_TEETH 30
+// D2-40, 4 cylinder 4 stroke, fires twice a revolution.
+#define TEETH_PER_FIRING 15
+#if defined(TOOTH_PERIODS) && !defined(FREQENCY_METHOD_2)
+#error TOOTH_PERIODS requires FREQENCY_METHOD_2
+#endif
+
+/**
+ * Edges for the next capture, given the edges and TCA0 ticks of the one just taken.
+ * Called from the capture ISR.
+ */
+inline uint8_t adaptCaptureEdges(uint8_t edges, uint32_t ticks) {
+  if ( ticks > 2UL*RPM_GATE_TARGET_TICKS && edges > RPM_GATE_MIN_EDGES ) {
+    return edges >> 1;
+  } else if ( ticks < RPM_GATE_TARGET_TICKS/2 && edges < RPM_GATE_MAX_EDGES ) {
+    return edges << 1;
+  }
+  return edges;
+}
+
+#ifdef __AVR_TINY_2__
+#if defined(FREQENCY_METHOD_2) || defined(FREQENCY_METHOD_3)
+/**
+ * Time base shared by the gated captures, TCA0 at clk/64 (250KHz) with an overflow count,
+ * see gatecapture.cpp.
+ */
+#define CAPTURE_TIMEBASE_HZ 250000.0
+extern volatile uint16_t timerISRCalls;
+void setupCaptureTimebase();
+
+// TCA0 as a 32 bit timestamp, overflow count in the top 16 bits. Called with interrupts
+// disabled, so an overflow since the last TCA0_OVF_vect is still pending in INTFLAGS.
+// If pending and CNT has wrapped (is in the lower half) the overflow is counted here.
+inline uint32_t captureTimestamp() {
+  uint16_t count = TCA0.SINGLE.CNT;
+  uint16_t overflows = timerISRCalls;
+  if ( (TCA0.SINGLE.INTFLAGS & TCA_SINGLE_OVF_bm) && count < 0x8000 ) {
+    overflows++;
+  }
+  return (((uint32_t)overflows)<<16) | count;
+}
+
+/**
+ * The last two captures of a frequency input, each the timestamp after a gate
+ * of edges, the gate adapting to keep captures near RPM_GATE_TARGET_TICKS.
+ * capture is called from the ISR that counts the edges, read from the main loop.
+ */
+struct GateCapture {
+    volatile uint8_t captureEdges = RPM_GATE_INITIAL_EDGES;
+    volatile uint8_t slot = 0;
+    volatile uint8_t capturedSlot = 0;
+    volatile uint32_t capturedTimes[2] = { 0,0 };
+    volatile uint8_t capturedEdges[2] = { 0,0 };
+    volatile uint16_t captures = 0;
+    uint16_t lastCaptures = 0;
+    bool stopped = true;  // at the last read, no capture for RPM_GATE_MAX_TICKS
+
+    // returns the ticks since the previous capture.
+    inline uint32_t capture(uint32_t t, uint8_t edges) {
+      uint32_t period = t - capturedTimes[capturedSlot];
+      capturedTimes[slot] = t;
+      capturedEdges[slot] = edges;
+      capturedSlot = slot;
+      slot = (slot+1)&0x01;
+      captures++;
+      captureEdges = adaptCaptureEdges(edges, period);
+      return period;
+    };
+    void read(FrequencyCapture &frequencyCapture, bool outputDebug);
+};
+
+#ifdef ALTERNATOR_W_TERMINAL
+// Alternator W terminal, conditioned to logic levels on PC4, sharing PORTC_PORT_vect
+// with the flywheel on FREQENCY_METHOD_2.
+extern GateCapture alternatorCapture;
+extern volatile uint8_t alternatorEdges;
+extern volatile uint16_t alternatorISRCalls;
+inline void alternatorEdge() {
+  alternatorISRCalls++;
+  alternatorEdges++;
+  if ( alternatorEdges >= alternatorCapture.captureEdges ) {
+    alternatorCapture.capture(captureTimestamp(), alternatorEdges);
+    alternatorEdges = 0;
+  }
+}
+#endif
+
+#endif
+#endif
+
+#ifdef ALTERNATOR_W_TERMINAL
+#if !defined(__AVR_TINY_2__) || !(defined(FREQENCY_METHOD_2) || defined(FREQENCY_METHOD_3))
+#error ALTERNATOR_W_TERMINAL requires FREQENCY_METHOD_2 or FREQENCY_METHOD_3
+#endif
+void setupAlternatorCapture();
+void readAlternatorCapture(FrequencyCapture &capture, bool outputDebug);
+#endif
+
+
 
 
 #define EVENTS_NO_EVENT 0  // also represents current engine hours
@@ -115,6 +318,7 @@
 #define EVENT_EXHAUST_TEMP 4
 #define EVENT_ALTERNATOR_TEMP 5
 #define EVENT_ENGINE_ROOM_TEMP 6
+#define EVENT_BELT_SLIP 7
 
 class LocalStorage {
 public:
@@ -123,6 +327,14 @@ public:
     void setVdd(double vdd);
     void loadEngineHours();
     void saveEngineHours();
+#ifdef ALTERNATOR_W_TERMINAL
+    void loadAlternatorRatio();
+    void saveAlternatorRatio();
+#endif
+#ifdef ENGINE_LOAD_ESTIMATE
+    void loadFuelUsed();
+    void saveFuelUsed();
+#endif
 
     void clearEvents();
     void saveEvent(uint8_t eventId);
@@ -131,33 +343,367 @@ public:
 
     uint32_t engineHoursPeriods = 0;
     double vdd = 5.0;
+    uint16_t vddMv = 5000; // vdd for integer conversions
+#ifdef ALTERNATOR_W_TERMINAL
+    double alternatorRatio = 0; // W terminal Hz/flywheel Hz, 0 until learnt
+#endif
+#ifdef ENGINE_LOAD_ESTIMATE
+    uint32_t fuelUsedMl = 0;       // estimated since new
+    int16_t tankReferenceLevel = -1; // 0.01%, at the last refill, -1 none
+    uint32_t tankReferenceMl = 0;  // fuelUsedMl at the last refill
+#endif
 private:
     void updateBlockCRC(uint8_t crc_offset, uint8_t block_len);
     bool eepromBlockValid(uint8_t crc_offset, uint8_t block_len);
 };
 
+// Background ADC sampling.
+// All ADC channels are converted round robin in the background, on the 3226 driven
+// by the ADC result ready interrupt, on other MCUs one conversion per call to poll().
+// Each channel keeps the last ADC_SAMPLER_DEPTH readings for a median of 3 spike filter
+// followed by an IIR, reads return the IIR output.
+#define ADC_SAMPLER_CHANNELS 8
+#define ADC_SAMPLER_DEPTH 4  // must be a power of 2
+// Readings are stored with 2 bits more than the 12 bit ADC, ie 0-16383.
+// readFine() returns this resolution, read() the native ADC resolution.
+#define ADC_FINE_BITS 14
+#define ADC_FINE_SHIFT 2  // ADC_FINE_BITS-12, to scale 4096 curves to fine readings.
+// returned for a channel that has not completed a ring of conversions or is not registered.
+#define ADC_SAMPLER_NO_DATA -1
+
+// IIR filter per channel, alpha = 1/2^n. Time constant is ~2^n * 15ms on the 3226.
+// Exhaust and alternator need to follow a raw water failure so are kept short,
+// the fuel sender is slowed down to average out slosh.
+#define ADC_FILTER_NTC 3      // ~120ms
+#define ADC_FILTER_COOLANT 4  // ~240ms
+#define ADC_FILTER_VOLTAGE 3
+#define ADC_FILTER_OIL 3
+#define ADC_FILTER_FUEL 6     // ~1s
+
+// Oversampling, selected per channel.
+// On the 3226 each background conversion is a burst of 2^ADC_ACCUMULATE_x samples
+// accumulated in hardware and decimated to ADC_FINE_BITS, so 4 (16 samples) gives
+// the full 2 extra bits, more reduces noise further. Sample duration is in ADC clocks
+// (300KHz). The PGA at 1x buffers the high impedance 100K/47K voltage dividers, which
+// allows a shorter sample duration than charging the sample cap directly.
+// On other MCUs there is no accumulator and a single sample is taken.
+#ifdef __AVR_TINY_2__
+#define ADC_ACCUMULATE_NTC 5       // 32 samples, ~2.8ms
+#define ADC_SAMPDUR_NTC 10
+#define ADC_ACCUMULATE_COOLANT 4   // 16 ABBA pairs of coolant and its supply, ~2.7ms
+#define ADC_SAMPDUR_COOLANT 10
+#define ADC_ACCUMULATE_VOLTAGE 4   // 16 samples, ~1.4ms
+#define ADC_SAMPDUR_VOLTAGE 10
+#define ADC_ACCUMULATE_SENDER 4    // oil and fuel senders, low impedance.
+#define ADC_SAMPDUR_SENDER 4
+#define ADC_PGA true
+#else
+#define ADC_ACCUMULATE_NTC 0
+#define ADC_SAMPDUR_NTC 0
+#define ADC_ACCUMULATE_COOLANT 1   // 2 ABBA pairs, blocking in poll()
+#define ADC_SAMPDUR_COOLANT 0
+#define ADC_ACCUMULATE_VOLTAGE 0
+#define ADC_SAMPDUR_VOLTAGE 0
+#define ADC_ACCUMULATE_SENDER 0
+#define ADC_SAMPDUR_SENDER 0
+#define ADC_PGA false
+#endif
+
+class AdcSampler {
+public:
+    AdcSampler() {};
+    bool addChannel(uint8_t pin, uint8_t filter, uint8_t accumulate, uint8_t sampleDuration, bool viaPga=false);
+    bool addPair(uint8_t pinA, uint8_t pinB, uint8_t filter, uint8_t accumulate, uint8_t sampleDuration, bool viaPgaA=false, bool viaPgaB=false);
+    void begin();
+    void poll();
+    int16_t read(uint8_t pin);
+    int16_t readFine(uint8_t pin);
+    int16_t readDirect(uint8_t pin);
+    uint16_t getConversions();
+private:
+    int8_t findChannel(uint8_t pin);
+    void start();
+};
+
+// Sensor ids, the index of the value in EngineSnapshot::value.
+// Values are scaled integers, temperatures in 0.1C, voltages in mV, pressures in Pa
+// and levels in 0.01%.
+#define SENSOR_COOLANT_TEMPERATURE    0
+#define SENSOR_ALTERNATOR_VOLTAGE     1
+#define SENSOR_ENGINE_BATTERY_VOLTAGE 2
+#define SENSOR_OIL_PRESSURE           3
+#define SENSOR_FUEL_LEVEL             4
+#define SENSOR_EXHAUST_TEMPERATURE    5
+#define SENSOR_ALTERNATOR_TEMPERATURE 6
+#define SENSOR_ENGINEROOM_TEMPERATURE 7
+#define SENSOR_CHANNELS               8
+#define SENSOR_NONE                   0xff
+// value of a sensor that is not available.
+#define SENSOR_NA INT32_MIN
+
+// EngineSnapshot valid bits, set when the value is available, 1<<sensor id.
+#define SNAPSHOT_COOLANT_TEMPERATURE    0x0001
+#define SNAPSHOT_ALTERNATOR_VOLTAGE     0x0002
+#define SNAPSHOT_ENGINE_BATTERY_VOLTAGE 0x0004
+#define SNAPSHOT_OIL_PRESSURE           0x0008
+#define SNAPSHOT_FUEL_LEVEL             0x0010
+#define SNAPSHOT_EXHAUST_TEMPERATURE    0x0020
+#define SNAPSHOT_ALTERNATOR_TEMPERATURE 0x0040
+#define SNAPSHOT_ENGINEROOM_TEMPERATURE 0x0080
+
+// Sensor conversions.
+// All conversions are integer, values only become doubles when sent.
+// NTC to VDD, fine reading looked up in the curve, 0.1C.
+#define CONVERSION_NTC 0
+// NTC powered from the reference channel, sampled as a ratiometric pair with it,
+// scaled to a 12V supply and looked up in the curve, 0.1C.
+#define CONVERSION_RATIOMETRIC_NTC 1
+// Linear, ((mV-offset)*scale)>>shift, clamped to 0..limit, NA below minMv or above maxValue.
+// mV is relative to Vdd for sensors with their own supply.
+#define CONVERSION_LINEAR_VDD 2
+// As CONVERSION_LINEAR_VDD for sensors supplied from Vdd where mV is relative to a nominal 5V.
+#define CONVERSION_LINEAR_5V 3
+
+// Linear conversion constants, from value units per mV and volts.
+#define SENSOR_SCALE(unitsPerMv, shift) ((int32_t)((unitsPerMv)*(1L<<(shift))+0.5))
+#define SENSOR_MV(volts) ((int16_t)((volts)*1000))
+
+/**
+ * A lookup curve, ADC readings at 4096 resolution, falling with temperature,
+ * value[i] = min+step*i in 0.1C. Generated at compile time, see curves.h.
+ */
+struct ConversionCurve {
+    const int16_t *table;  // PROGMEM
+    const uint16_t *reciprocal;  // PROGMEM, per segment
+    const uint8_t *index;  // PROGMEM, segment per coarse reading
+    int16_t min;
+    int16_t step;
+    uint8_t length;
+};
+
+extern const ConversionCurve coolantCurve PROGMEM;
+extern const ConversionCurve ntcCurveNMF5210K PROGMEM;
+
+/**
+ * Descriptor of one sensor channel, held in PROGMEM.
+ * EngineSensors samples, converts and snapshots every channel in the table,
+ * so adding a sensor is a new entry. pgn, instance and source identify the message
+ * the value is sent in, 130316 temperatures are sent from the table.
+ */
+struct SensorChannel {
+    uint8_t id;             // SENSOR_x
+    uint8_t pin;
+    uint8_t conversion;     // CONVERSION_x
+    uint8_t reference;      // id of the supply channel for CONVERSION_RATIOMETRIC_NTC, else SENSOR_NONE
+    uint8_t filter;         // ADC_FILTER_x
+    uint8_t accumulate;     // ADC_ACCUMULATE_x
+    uint8_t sampleDuration; // ADC_SAMPDUR_x
+    bool viaPga;
+    const ConversionCurve *curve;  // NTC conversions
+    int16_t offset;         // linear conversions, mV
+    int32_t scale;          // SENSOR_SCALE
+    uint8_t shift;
+    int16_t minMv;
+    int32_t maxValue;
+    int32_t limit;
+    uint32_t pgn;
+    uint8_t instance;
+    uint8_t source;
+};
+
+/**
+ * All sensor values converted once per SNAPSHOT_PERIOD, so every message sent
+ * and every line of the serial monitor in a cycle is consistent.
+ * Sensor values are scaled integers, see SENSOR_x, SENSOR_NA with the corresponding
+ * valid bit clear when not available. The getters convert to the SI units used by
+ * SNMEA2000 when a value is sent, returning SNMEA2000::n2kDoubleNA when not available.
+ */
+struct EngineSnapshot {
+    unsigned long timestamp = 0; // millis() when taken
+    uint16_t valid = 0;
+    bool engineRunning = false;
+    bool engineStopping = false;  // stop solenoid energised
+    bool shuttingDown = false;    // stop solenoid energised or rpm falling after a stop
+    bool alarmsEnabled = false;   // engine running and past the start grace period
+    uint16_t status1 = 0;
+    uint16_t status2 = 0;
+    double engineRPM = 0;
+    double engineRPMRate = 0;  // RPM/s
+    uint8_t rpmSensors = 0;    // RPM_SENSOR_x
+#ifdef ENGINE_LOAD_ESTIMATE
+    double engineLoad = 0;     // %
+    double fuelRate = 0;       // l/h
+    double fuelUsed = 0;       // l, estimated since new
+    bool tankChecked = false;  // a refill has been seen and the fuel level is valid
+    double tankUsed = 0;       // l, from the tank level since the last refill
+    double tankEstimatedUsed = 0; // l, estimated since the last refill
+#endif
+    double engineSeconds = 0;
+    int32_t value[SENSOR_CHANNELS];  // by sensor id
+    bool isValid(uint16_t mask) const { return (valid & mask) == mask; };
+    double getTemperatureK(uint8_t id) const;
+    double getVoltage(uint8_t id) const;
+    double getPressure(uint8_t id) const;
+    double getPercent(uint8_t id) const;
+};
+
+/**
+ * Alpha-beta filter of the measured RPM, estimating RPM and its rate of change.
+ * Both gains come from a single discount factor theta (critically damped), trading
+ * latency against jitter. A measurement of 0 (stopped or invalid) resets the filter
+ * so stops are reported immediately, the first measurement after is taken as is.
+ */
+class RpmFilter {
+public:
+    RpmFilter(double theta) :
+        alpha(1.0-theta*theta),
+        beta((1.0-theta)*(1.0-theta)) {};
+    void update(double measuredRPM, double dt);
+    double rpm = 0;
+    double rate = 0; // RPM/s
+private:
+    double alpha;
+    double beta;
+};
+
+#ifdef ENGINE_LOAD_ESTIMATE
+// Flywheel, gearbox, shaft and propeller. Accelerating them takes power over the propeller curve.
+#define ENGINE_INERTIA 0.5 // kg m2
+// Fuel for power over the propeller curve, 250g/kWh of diesel at 0.84kg/l.
+#define FUEL_PER_KWH 0.3 // l
+// Integrated fuel is saved this often while running and when the engine stops.
+#define FUEL_SAVE_PERIOD 300000UL
+// A rise in tank level of more than this, 0.01%, while stopped is a refill.
+#define TANK_REFILL_LEVEL 1000
+
+/**
+ * A point on the D2-40 propeller curve, see loadestimator.cpp.
+ */
+struct PropellerCurvePoint {
+    uint16_t rpm;
+    uint16_t power;     // propeller curve, 0.1kW
+    uint16_t maxPower;  // full load curve, 0.1kW
+    uint16_t fuelRate;  // on the propeller curve, 0.01 l/h
+};
+
+/**
+ * Estimates engine load and fuel rate from RPM and its rate of change.
+ * In gear on a fixed propeller the power absorbed follows the propeller curve,
+ * accelerating adds ENGINE_INERTIA. Load is power over the full load power at that RPM.
+ * Out of gear the load is overestimated.
+ */
+class LoadEstimator {
+public:
+    LoadEstimator() {};
+    void update(double rpm, double rpmRate);
+    double load = 0;      // %
+    double fuelRate = 0;  // l/h
+};
+#endif
+
+#ifdef CLOCK_CALIBRATION
+// Seconds of reference time per measurement, 10ms of receive latency is 3e-5.
+#define CLOCK_CALIBRATION_PERIOD 300
+// A measurement further than this from 1.0 is not oscillator drift and is rejected.
+#define CLOCK_CALIBRATION_LIMIT 0.03
+// running average of measurements.
+#define CLOCK_CALIBRATION_SAMPLES 4.0
+
+/**
+ * Measures the CPU clock against the time of day in PGN 126992 from a GPS on the bus,
+ * so RPM follows the internal oscillator as it drifts with the engine room temperature
+ * rather than relying on the tuning alone. The local clock is micros(), the same CPU
+ * clock all the frequency methods count. The first source seen is used, a gap, a step
+ * or midnight restarts the measurement. correction multiplies frequencies measured
+ * against the CPU clock, 1.0 until the first measurement.
+ */
+class ClockCalibration {
+public:
+    ClockCalibration() {};
+    void reference(uint8_t source, uint32_t timeOfDay, unsigned long localMicros);
+    double correction = 1.0;
+    uint16_t measurements = 0;
+    uint8_t referenceSource = 0xff;
+private:
+    void restart(uint32_t timeOfDay, unsigned long localMicros);
+    uint32_t startTime = 0;     // 0.0001s since midnight
+    uint32_t lastTime = 0;
+    unsigned long startMicros = 0;
+    unsigned long lastMicros = 0;
+};
+#endif
+
+/**
+ * Evaluates all alarms from an EngineSnapshot.
+ * Called once per snapshot so alarm windows are measured against the
+ * snapshot timestamp at a fixed rate, independently of how often values are read.
+ * Events are saved to local storage when an alarm is first raised.
+ */
+class AlarmEvaluator {
+public:
+    AlarmEvaluator(LocalStorage &localStorage) : localStorage(localStorage) {};
+    void evaluate(const EngineSnapshot &snapshot);
+    void reset();
+
+    uint16_t status1 = 0;
+    uint16_t status2 = 0;
+private:
+    void evaluateOilPressure(const EngineSnapshot &snapshot, bool running);
+    void evaluateVoltages(const EngineSnapshot &snapshot, bool running);
+    void evaluateCoolant(const EngineSnapshot &snapshot);
+    void evaluateExhaust(const EngineSnapshot &snapshot);
+    void evaluateOverTemperature(const EngineSnapshot &snapshot);
+#ifdef ALTERNATOR_W_TERMINAL
+    void evaluateRpmSensors(const EngineSnapshot &snapshot);
+#endif
+    bool delayedTrigger(unsigned long &start, unsigned long window, unsigned long now);
+    void raise(bool &alarm, uint8_t eventId);
+
+    LocalStorage &localStorage;
+    // alarms sharing ENGINE_STATUS1_OVERTEMP, each cleared independently.
+    bool coolantOverTemp = false;
+    bool alternatorOverTemp = false;
+    bool engineRoomOverTemp = false;
+    bool lowOilPressure = false;
+    bool lowWaterFlow = false;
+    // these could be converted to uint8 by measuring 5s periods which would give
+    // a maximum duration of about 21m, saving 12 bytes of stack, probably not worth it.
+    unsigned long coolantOverTempStart = 0;
+    unsigned long lowAlternatorVoltageStart = 0;
+    unsigned long lowEngineBatteryVStart = 0;
+    unsigned long lowOilPressureStart = 0;
+    unsigned long highExhaustStart = 0;
+#ifdef ALTERNATOR_W_TERMINAL
+    bool beltSlip = false;
+    unsigned long beltSlipStart = 0;
+    unsigned long rpmSensorFaultStart = 0;
+#endif
+    // Rate-of-rise tracking for the exhaust elbow. exhaustRiseAnchor is the
+    // temperature recorded at exhaustRiseAnchorTime; a delta beyond
+    // EXHAUST_RISE_DELTA inside EXHAUST_RISE_WINDOW indicates raw water flow
+    // collapse before the absolute threshold trips.
+    unsigned long exhaustRiseAnchorTime = 0;
+    int16_t exhaustRiseAnchor = 0;
+};
+
 class EngineSensors {
     public:
 
        EngineSensors(
-                    uint8_t flywheelPin, 
-                    uint8_t adcAlternatorVoltage,
-                    uint8_t adcEngineBattery,
-                    uint8_t adcExhaustNTC1,
-                    uint8_t adcAlternatorNTC2,
-                    uint8_t adcEngineRoomNTC3,
+                    uint8_t flywheelPin,
+                    const SensorChannel *channels, // PROGMEM
+                    uint8_t nChannels,
                     unsigned long flywheelReadPeriod=DEFAULT_FLYWHEEL_READ_PERIOD
-                    ) {
+                    ) : alarms(localStorage), rpmFilter(RPM_FILTER_THETA) {
                         this->flywheelReadPeriod = flywheelReadPeriod;
                         this->flywheelPin = flywheelPin;
-                        this->adcAlternatorVoltage = adcAlternatorVoltage;
-                        this->adcEngineBattery = adcEngineBattery;
-                        this->adcExhaustNTC1 = adcExhaustNTC1;
-                        this->adcAlternatorNTC2 = adcAlternatorNTC2;
-                        this->adcEngineRoomNTC3 = adcEngineRoomNTC3;
+                        this->channels = channels;
+                        this->nChannels = nChannels;
                      };
        bool begin();
        void read(bool outoutDebug=false);
+       void updateSnapshot(bool outputDebug=false);
+       const EngineSnapshot & getSnapshot() { return snapshot; };
        bool isEngineRunning();
        void saveEngineHours();
        void setEngineSeconds(double seconds);
@@ -166,18 +712,24 @@ class EngineSensors {
        double getEngineRPM();
 
        double getEngineSeconds();
-       double getFuelLevel(uint8_t adc, bool outoutDebug=false);
-       double getOilPressure(uint8_t adc, bool outoutDebug=false);
        double getFuelCapacity();
-       double getCoolantTemperatureK(uint8_t coolantAdc, uint8_t batteryAdc, bool outoutDebug=false);
-       double getTemperatureK(uint8_t adc, bool outoutDebug=false);
-       double getVoltage(uint8_t adc, bool outoutDebug=false);
+       uint8_t getChannelCount() { return nChannels; };
+       void getChannel(uint8_t i, SensorChannel &channel);
        void dumpADC(uint8_t adc);
+       void dumpADCs();
        void dumpADCVDD();
 
        void setStoredVddVoltage(double measuredVddVoltage);
        double getStoredVddVoltage();
        void readEngineRPM(bool outoutDebug=false);
+       const FrequencyCapture & getFrequencyCapture() { return frequencyCapture; };
+#ifdef ALTERNATOR_W_TERMINAL
+       const FrequencyCapture & getAlternatorCapture() { return wTerminalCapture; };
+#endif
+#ifdef TOOTH_PERIODS
+       bool getRoughness(uint16_t &roughness, uint16_t &imbalance, uint8_t &revolutions);
+       void dumpToothProfile();
+#endif
 
 
        uint16_t getEngineStatus1();
@@ -187,73 +739,83 @@ class EngineSensors {
        void dumpEngineStatus2();
 
         LocalStorage localStorage;
+        AdcSampler adcSampler;
+#ifdef CLOCK_CALIBRATION
+        ClockCalibration clockCalibration;
+#endif
+
+        // no state, host tested, see test/host.
+        static int16_t interpolate(int16_t reading, const ConversionCurve *curve);
 
     private:
         void loadEngineHours();
         void writeEnginHours();
         void updateEngineStatus();
         void checkStop();
-        bool delayedTrigger(unsigned long &start, unsigned long window);
-        int16_t readAdcSampled(uint8_t adc);
-
+        int32_t convert(const SensorChannel &channel, bool outputDebug);
+        int32_t convertNTC(const SensorChannel &channel, int16_t reading);
+        int32_t convertRatiometricNTC(const SensorChannel &channel, int16_t reading, bool outputDebug);
+        int32_t convertLinear(const SensorChannel &channel, int16_t reading);
+        uint8_t findPin(uint8_t id);
+#ifdef TOOTH_PERIODS
+        void readToothPeriods();
+#endif
+#ifdef ALTERNATOR_W_TERMINAL
+        void crossCheckAlternator(bool outputDebug);
+#endif
+#ifdef ENGINE_LOAD_ESTIMATE
+        void updateFuelUsed(double dt);
+        void checkTank();
+#endif
 
-        int16_t interpolate(
-            int16_t reading, 
-            int16_t minCurveValue, 
-            int16_t maxCurveValue,
-            int step, 
-            const int16_t *curve, 
-            int curveLength
-            );
 
       
         uint8_t flywheelPin;
-        uint8_t adcAlternatorVoltage;
-        uint8_t adcEngineBattery;
-        uint8_t adcExhaustNTC1;
-        uint8_t adcAlternatorNTC2;
-        uint8_t adcEngineRoomNTC3;
+        const SensorChannel *channels;
+        uint8_t nChannels;
         unsigned long flywheelReadPeriod = DEFAULT_FLYWHEEL_READ_PERIOD;
 
-        double engineRPM = 0;
+        double measuredRPM = 0; // by readEngineRPM
+        double engineRPM = 0;   // filtered
         bool engineRunning = false;
         bool engineStopping = false;
-        uint16_t status1 = 0;
-        uint16_t status2 = 0;
+        bool shuttingDown = false;
+        AlarmEvaluator alarms;
+        RpmFilter rpmFilter;
         bool fakeEngineRunning = false;
+        FrequencyCapture frequencyCapture;
+        uint8_t rpmSensors = 0;
+#ifdef ENGINE_LOAD_ESTIMATE
+        LoadEstimator loadEstimator;
+        double pendingFuelMl = 0; // not yet in LocalStorage::fuelUsedMl
+        unsigned long lastFuelSave = 0;
+#endif
+#ifdef ALTERNATOR_W_TERMINAL
+        FrequencyCapture wTerminalCapture;
+#endif
 
 
 #ifdef __AVR_TINY_2__
-#ifdef FREQENCY_METHOD_1
-        uint16_t lastInteruptCount = 0;
-        uint16_t smoothedRPM[4];
-        uint8_t slot = 0;
-#endif
-#ifdef FREQENCY_METHOD_2
-        uint16_t edgeInterrupts[2] = {0,0};
-        uint16_t overflowInterrupts[2] = {0,0};
+#ifdef TOOTH_PERIODS
+        uint16_t lastRevolution = 0;
+        uint8_t roughnessRevolutions = 0;
+        uint32_t roughnessSum = 0;
+        uint32_t imbalanceSum = 0;
+        int8_t toothProfile[FLYWHEEL_TEETH] = {0}; // last revolution, 0.1% from the mean period
 #endif
 
 #endif
         bool eepromWritten = false;
         bool canEmitAlarms = false;
+        // alarms when the engine stopped, reported until the next start so they reach the displays.
+        uint16_t stoppedStatus1 = 0;
+        uint16_t stoppedStatus2 = 0;
+        EngineSnapshot snapshot;
+        unsigned long lastSnapshotTime = 0;
         unsigned long lastFlywheelReadTime = 0;
         unsigned long lastCheckStop = 0;
         unsigned long lastEngineHoursTick = 0; 
         unsigned long engineStarted = 0;
-        // these could be converted to uint8 by measuring 5s periods which would give
-        // a maximum duration of about 21m, saving 12 bytes of stack, probably not worth it.
-        unsigned long coolantOverTempStart = 0;
-        unsigned long lowAlternatorVoltageStart = 0;
-        unsigned long lowEngineBatteryVStart = 0;
-        unsigned long lowOilPressureStart = 0;
-        unsigned long highExhaustStart = 0;
-        // Rate-of-rise tracking for the exhaust elbow. exhaustRiseAnchor is the
-        // temperature recorded at exhaustRiseAnchorTime; a delta beyond
-        // EXHAUST_RISE_DELTA inside EXHAUST_RISE_WINDOW indicates raw water flow
-        // collapse before the absolute threshold trips.
-        unsigned long exhaustRiseAnchorTime = 0;
-        int16_t exhaustRiseAnchor = 0;
 };
 
 #endif
\ No newline at end of file
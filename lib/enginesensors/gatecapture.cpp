@@ -0,0 +1,99 @@
+#include "enginesensors.h"
+
+#ifdef __AVR_TINY_2__
+#if defined(FREQENCY_METHOD_2) || defined(FREQENCY_METHOD_3)
+
+/**
+ * Gated frequency captures against a free running TCA0, shared by the flywheel
+ * (FREQENCY_METHOD_2 and FREQENCY_METHOD_3) and the alternator W terminal.
+ *
+ * TCA0 at CPU_PER/64 gives 250 Khz and 0.26s before overflow. Overflows are counted
+ * by the ISR to extend it to a 32 bit timestamp, see captureTimestamp.
+ */
+
+volatile uint16_t timerISRCalls = 0;
+
+// interupt on overflow.
+ISR(TCA0_OVF_vect) {
+  timerISRCalls++;
+  TCA0.SINGLE.INTFLAGS  = TCA_SINGLE_OVF_bm; // Always remember to clear the interrupt flags, otherwise the interrupt will fire continually!
+}
+
+void setupCaptureTimebase() {
+  // Counter needs to be setup with clock/64 and overflow interrupts running
+  takeOverTCA0();
+
+  // 16000000/64 = 250KHz 250000/2^16 =  3.8146972656 overflows/s
+  TCA0.SINGLE.CTRLA = TCA_SINGLE_CLKSEL0_bm | TCA_SINGLE_CLKSEL2_bm; // div 64
+  TCA0.SINGLE.CTRLB = 0x00; // norma, just want the counter, no output.
+  TCA0.SINGLE.CTRLC = 0x00; // nothing to set
+  TCA0.SINGLE.PER = 0xFFFF; // Count all the way up to 0xFFFF
+  TCA0.SINGLE.INTCTRL = TCA_SINGLE_OVF_bm; //enable overflow interrupt
+  TCA0.SINGLE.CTRLA |= TCA_SINGLE_ENABLE_bm; //enable the timer keeping the prescaler.
+}
+
+/**
+ * Frequency from the last two captures.
+ * Noise at over 4KHz (ie 8KRPM at the flywheel) is ignored ( ticks > 60 per edge)
+ * as is an input with no capture for RPM_GATE_MAX_TICKS, stopped, or where the last two
+ * span a stop. Reads are faster than captures at some speeds, the last capture is reused
+ * until there is a new one.
+ */
+void GateCapture::read(FrequencyCapture &frequencyCapture, bool outputDebug) {
+  noInterrupts();
+  uint8_t l = capturedSlot;
+  uint8_t p = l^0x01;
+  uint32_t ticks = capturedTimes[l] - capturedTimes[p];
+  uint32_t age = captureTimestamp() - capturedTimes[l];
+  uint8_t gate = capturedEdges[l];
+  uint16_t captureCount = captures;
+  interrupts();
+
+  frequencyCapture.samples = gate;
+  stopped = age >= RPM_GATE_MAX_TICKS;
+  if ( age < RPM_GATE_MAX_TICKS && ticks > 60UL*gate && ticks < RPM_GATE_MAX_TICKS) {
+    frequencyCapture.frequency = (double)gate*CAPTURE_TIMEBASE_HZ/(double) ticks;
+    frequencyCapture.confidence = (captureCount != lastCaptures)?100:50;
+  } else {
+    frequencyCapture.frequency = 0;
+    frequencyCapture.confidence = 0;
+  }
+  lastCaptures = captureCount;
+
+#ifdef WITH_DEBUG
+  if ( outputDebug ) {
+    Serial.print(F("gate:"));
+    Serial.print(gate);
+    Serial.print(F(" ticks:"));
+    Serial.println(ticks);
+  }
+#endif
+}
+
+#ifdef ALTERNATOR_W_TERMINAL
+
+GateCapture alternatorCapture;
+volatile uint8_t alternatorEdges = 0;
+volatile uint16_t alternatorISRCalls = 0;
+uint16_t lastAlternatorISRCalls = 0;
+
+void setupAlternatorCapture() {
+  PORTC.PIN4CTRL |= PORT_ISC_FALLING_gc | PORT_PULLUPEN_bm ; // pullup on the input pin
+#ifdef WITH_DEBUG
+  Serial.println("Alternator W terminal on PC4 setup done");
+#endif
+}
+
+void readAlternatorCapture(FrequencyCapture &capture, bool outputDebug) {
+  alternatorCapture.read(capture, outputDebug);
+  noInterrupts();
+  uint16_t isrCalls = alternatorISRCalls;
+  interrupts();
+  capture.isrCalls = isrCalls - lastAlternatorISRCalls;
+  lastAlternatorISRCalls = isrCalls;
+}
+
+#endif
+
+#endif
+#endif
@@ -0,0 +1,35 @@
+#include "enginesensors.h"
+#include "thermistor.h"
+
+/**
+ *  convert a reading from a ntc into a temperature using a curve.
+ *  The reading is a fine reading (ADC_FINE_BITS), the curve is at 4096 resolution.
+ *  The coarse index gives the segment of the highest reading in the top bits of the
+ *  reading, at most 2 steps from the segment of the reading (tools/curve_tables.py).
+ *  Checked against the original linear scan on the host by test/host/test_interpolate.cpp.
+ *  Ratiometric readings scaled to a 12V supply can be above the index, those scan from
+ *  the first segment, only the first points of the coolant curve are above it.
+ *  The segment converts with its reciprocal slope, a multiply and shift in 32 bits.
+ */ 
+int16_t EngineSensors::interpolate(int16_t reading, const ConversionCurve *curve) {
+  const int16_t *table = (const int16_t *)pgm_read_ptr(&curve->table);
+  int16_t minValue = (int16_t)pgm_read_word(&curve->min);
+  int16_t step = (int16_t)pgm_read_word(&curve->step);
+  uint8_t length = pgm_read_byte(&curve->length);
+  const uint8_t *index = (const uint8_t *)pgm_read_ptr(&curve->index);
+  uint8_t s = 0;
+  if ( (uint16_t)reading < (CURVE_INDEX_LENGTH<<CURVE_INDEX_SHIFT) ) {
+    s = pgm_read_byte(&index[reading>>CURVE_INDEX_SHIFT]);
+  }
+  while ( s < length && reading <= (((int16_t)pgm_read_word(&table[s]))<<ADC_FINE_SHIFT) ) {
+    s++;
+  }
+  if ( s == 0 ) {
+    return minValue;
+  } else if ( s == length ) {
+    return minValue+(length-1)*step;
+  }
+  const uint16_t *reciprocal = (const uint16_t *)pgm_read_ptr(&curve->reciprocal);
+  int16_t cvp = ((int16_t)pgm_read_word(&table[s-1]))<<ADC_FINE_SHIFT;
+  return minValue+(s-1)*step+(int16_t)(((int32_t)(cvp-reading)*pgm_read_word(&reciprocal[s]))>>CURVE_RECIPROCAL_BITS);
+}
@@ -0,0 +1,70 @@
+#include "enginesensors.h"
+
+#ifdef ENGINE_LOAD_ESTIMATE
+
+/*
+Volvo Penta D2-40, 29kW at 3200 RPM.
+Propeller power is the cube law through the rated power, 29*(rpm/3200)^3.
+Full load power is ~70Nm at 800 RPM rising to ~95Nm from 2000 RPM, limited to 29kW.
+Fuel on the propeller curve is 250g/kWh at 0.84kg/l plus 0.3+0.0001*rpm l/h for
+friction and pumping losses, ~0.5l/h at idle.
+These are approximations, the tank level cross-check shows how close they are.
+*/
+const PropellerCurvePoint propellerCurve[] PROGMEM = {
+  //  rpm, 0.1kW, max 0.1kW, 0.01 l/h
+  {    800,     5,    59,    51 },
+  {   1200,    15,    98,    88 },
+  {   1600,    36,   145,   154 },
+  {   2000,    71,   199,   261 },
+  {   2400,   122,   239,   418 },
+  {   2800,   194,   279,   636 },
+  {   3200,   290,   290,   925 }
+};
+#define PROPELLER_CURVE_POINTS (sizeof(propellerCurve)/sizeof(PropellerCurvePoint))
+
+/**
+ * Interpolate the propeller curve at rpm, then add the power to accelerate
+ * ENGINE_INERTIA at rpmRate, RPM/s. Load and fuel are 0 when stopped, past the
+ * ends of the curve the end points are used.
+ */
+void LoadEstimator::update(double rpm, double rpmRate) {
+  if ( rpm <= 0 ) {
+    load = 0;
+    fuelRate = 0;
+    return;
+  }
+  PropellerCurvePoint a, b;
+  memcpy_P(&a, &propellerCurve[0], sizeof(PropellerCurvePoint));
+  b = a;
+  double f = 0;
+  for (uint8_t i = 1; i < PROPELLER_CURVE_POINTS; i++) {
+    memcpy_P(&b, &propellerCurve[i], sizeof(PropellerCurvePoint));
+    if ( rpm < b.rpm ) {
+      if ( rpm > a.rpm ) {
+        f = (rpm - a.rpm)/(double)(b.rpm - a.rpm);
+      }
+      break;
+    }
+    a = b;
+    f = 0;
+  }
+  double power = 0.1*(a.power + f*((double)b.power - a.power));          // kW
+  double maxPower = 0.1*(a.maxPower + f*((double)b.maxPower - a.maxPower));
+  double propellerFuel = 0.01*(a.fuelRate + f*((double)b.fuelRate - a.fuelRate));
+
+  // J.w.dw/dt, w in rad/s, to kW.
+  double accelerating = 0.001*ENGINE_INERTIA*(rpm*0.10471976)*(rpmRate*0.10471976);
+  double total = power + accelerating;
+  if ( total < 0 ) {
+    total = 0;
+  } else if ( total > maxPower ) {
+    total = maxPower;
+  }
+  load = 100.0*total/maxPower;
+  fuelRate = propellerFuel + (total - power)*FUEL_PER_KWH;
+  if ( fuelRate < 0 ) {
+    fuelRate = 0;
+  }
+}
+
+#endif
@@ -57,6 +57,34 @@
 #define EVENTS_START 10
 #define EVENTS_LEN 126
 
+/**
+ * block calibration, ALTERNATOR_W_TERMINAL only, the ATtiny3226 has 256 bytes.
+ * starts eeprom offset 128
+ *
+ *  uint16_t crc16
+ *  uint16_t alternatorRatio in 1/10000, 0 not learnt.
+ */
+
+#define CALIBRATION_CRC 128
+#define CALIBRATION_ALTERNATOR_RATIO 130
+#define CALIBRATION_LEN 132
+
+/**
+ * block fuel, ENGINE_LOAD_ESTIMATE only.
+ * starts eeprom offset 132
+ *
+ *  uint16_t crc16
+ *  uint32_t fuelUsedMl estimated since new
+ *  uint16_t tankReferenceLevel 0.01% at the last refill, 0xffff none
+ *  uint32_t tankReferenceMl fuelUsedMl at the last refill
+ */
+
+#define FUEL_CRC 132
+#define FUEL_USED 134
+#define FUEL_TANK_LEVEL 138
+#define FUEL_TANK_USED 140
+#define FUEL_LEN 144
+
 
 
 
@@ -66,6 +94,7 @@ void LocalStorage::loadVdd() {
     storedVdd = EEPROM.read(EEPROM_VDD_SCALE) | EEPROM.read(EEPROM_VDD_SCALE+1)<<8; 
   }
   vdd = (double)(storedVdd)/10000.0;
+  vddMv = (storedVdd+5)/10;
   Serial.print(F("Loaded VDD: "));
   Serial.print(storedVdd);
   Serial.print(F(" V: "));
@@ -81,6 +110,7 @@ void LocalStorage::setVdd(double vdd) {
   EEPROM.update(EEPROM_VDD_SCALE+1, (storedVdd>>8)&0xff);
   updateBlockCRC(EEPROM_CRC, EEPROM_LEN);
   this->vdd = vdd;
+  vddMv = (storedVdd+5)/10;
   Serial.print(F("Set VDD: "));
   Serial.print(storedVdd);
   Serial.print(F(" V: "));
@@ -119,6 +149,65 @@ void LocalStorage::saveEngineHours() {
 }
 
 
+#ifdef ALTERNATOR_W_TERMINAL
+void LocalStorage::loadAlternatorRatio() {
+  uint16_t storedRatio = 0;
+  if ( eepromBlockValid(CALIBRATION_CRC, CALIBRATION_LEN) ) {
+    storedRatio = EEPROM.read(CALIBRATION_ALTERNATOR_RATIO) | EEPROM.read(CALIBRATION_ALTERNATOR_RATIO+1)<<8;
+  }
+  alternatorRatio = (double)(storedRatio)/10000.0;
+  Serial.print(F("Alternator ratio: "));
+  Serial.println(alternatorRatio, 4);
+}
+
+void LocalStorage::saveAlternatorRatio() {
+  uint16_t storedRatio = (alternatorRatio*10000);
+  EEPROM.update(CALIBRATION_ALTERNATOR_RATIO, storedRatio&0xff);
+  EEPROM.update(CALIBRATION_ALTERNATOR_RATIO+1, (storedRatio>>8)&0xff);
+  updateBlockCRC(CALIBRATION_CRC, CALIBRATION_LEN);
+}
+#endif
+
+#ifdef ENGINE_LOAD_ESTIMATE
+static uint32_t readUInt32(uint8_t offset) {
+  uint32_t v = EEPROM.read(offset+3);
+  v = v<<8 | EEPROM.read(offset+2);
+  v = v<<8 | EEPROM.read(offset+1);
+  v = v<<8 | EEPROM.read(offset);
+  return v;
+}
+
+static void updateUInt32(uint8_t offset, uint32_t v) {
+  EEPROM.update(offset, v&0xff);
+  EEPROM.update(offset+1, (v>>8)&0xff);
+  EEPROM.update(offset+2, (v>>16)&0xff);
+  EEPROM.update(offset+3, (v>>24)&0xff);
+}
+
+void LocalStorage::loadFuelUsed() {
+  if ( eepromBlockValid(FUEL_CRC, FUEL_LEN) ) {
+    fuelUsedMl = readUInt32(FUEL_USED);
+    tankReferenceLevel = (int16_t)(EEPROM.read(FUEL_TANK_LEVEL) | EEPROM.read(FUEL_TANK_LEVEL+1)<<8);
+    tankReferenceMl = readUInt32(FUEL_TANK_USED);
+  } else {
+    fuelUsedMl = 0;
+    tankReferenceLevel = -1;
+    tankReferenceMl = 0;
+  }
+  Serial.print(F("Fuel used l: "));
+  Serial.println(0.001*fuelUsedMl);
+}
+
+void LocalStorage::saveFuelUsed() {
+  updateUInt32(FUEL_USED, fuelUsedMl);
+  EEPROM.update(FUEL_TANK_LEVEL, tankReferenceLevel&0xff);
+  EEPROM.update(FUEL_TANK_LEVEL+1, (tankReferenceLevel>>8)&0xff);
+  updateUInt32(FUEL_TANK_USED, tankReferenceMl);
+  updateBlockCRC(FUEL_CRC, FUEL_LEN);
+}
+#endif
+
+
 /**
  * clear event memory
  */ 
@@ -0,0 +1,24 @@
+#include "enginesensors.h"
+
+
+/**
+ * Predict from the current estimate, then correct both RPM and rate
+ * by the residual. dt is the time since the last update in s.
+ */
+void RpmFilter::update(double measuredRPM, double dt) {
+  if ( measuredRPM <= 0 ) {
+    rpm = 0;
+    rate = 0;
+  } else if ( rpm == 0 || dt <= 0 ) {
+    rpm = measuredRPM;
+    rate = 0;
+  } else {
+    double predicted = rpm + rate*dt;
+    double residual = measuredRPM - predicted;
+    rpm = predicted + alpha*residual;
+    rate = rate + beta*residual/dt;
+    if ( rpm < 0 ) {
+      rpm = 0;
+    }
+  }
+}
@@ -0,0 +1,174 @@
+#ifndef THERMISTOR_H
+#define THERMISTOR_H
+
+#include <Arduino.h>
+#include "enginesensors.h"
+
+/*
+ Compile time generation of thermistor lookup curves.
+
+ A curve is described by the sensor and its divider, the sensor to ground with
+ rTop to supply, read by the ADC against vRef. The sensor is either a B parameter
+ NTC (b, r0 at t0) or, with b == 0, a list of resistances from a data sheet,
+ one per point. The ADC reading of each point at 4096 resolution, the per segment
+ reciprocal slopes and the coarse segment index used by EngineSensors::interpolate
+ are all evaluated by the compiler into PROGMEM, so recalibrating is a change of
+ parameters. tools/curve_tables.py mirrors this to check accuracy.
+
+ Everything here is C++11 constexpr, a single return statement per function,
+ so both the 3226 and 328 toolchains compile it. On AVR double is 32 bit.
+*/
+
+#define CURVE_RECIPROCAL_BITS 16
+// the index is keyed on the top 6 bits of a fine reading
+#define CURVE_INDEX_SHIFT (ADC_FINE_BITS-6)
+#define CURVE_INDEX_LENGTH 64
+
+struct ThermistorCurve {
+    double b;      // B parameter, 0 to use resistances.
+    double r0;     // resistance at t0
+    double t0;     // K
+    const uint16_t *resistances; // per point, when b == 0
+    double rTop;
+    double supply; // V
+    double vRef;   // V
+    int16_t min;   // 0.1C of the first point
+    int16_t step;  // 0.1C between points
+    uint8_t points;
+};
+
+namespace thermistor {
+
+constexpr double square(double x) { return x*x; }
+
+constexpr double expSeries(double x, int n, double term, double sum) {
+  return n > 16 ? sum : expSeries(x, n+1, term*x/n, sum+term*x/n);
+}
+
+// exp(x) = exp(x/2)^2 until |x| < 0.5 where the series converges quickly.
+constexpr double exp(double x) {
+  return (x > 0.5 || x < -0.5) ? square(exp(x/2)) : expSeries(x, 1, 1.0, 1.0);
+}
+
+constexpr double atanhSeries(double y, double y2, int n, double sum) {
+  return n > 31 ? sum : atanhSeries(y*y2, y2, n+2, sum+y*y2/(n+2));
+}
+
+// ln(x), reduced to 0.5 < x < 2 by powers of 2, then 2*atanh((x-1)/(x+1)).
+constexpr double log(double x) {
+  return x > 2.0 ? log(x/2)+0.69314718056
+    : x < 0.5 ? log(x*2)-0.69314718056
+    : 2.0*atanhSeries((x-1)/(x+1), square((x-1)/(x+1)), 1, (x-1)/(x+1));
+}
+
+constexpr double kelvin(const ThermistorCurve &c, int i) {
+  return 273.15+0.1*(c.min+c.step*i);
+}
+
+constexpr double resistance(const ThermistorCurve &c, int i) {
+  return c.b == 0 ? (double)c.resistances[i] : c.r0*exp(c.b*(1.0/kelvin(c, i) - 1.0/c.t0));
+}
+
+constexpr double adcFromResistance(const ThermistorCurve &c, double r) {
+  return 4096.0*c.supply/c.vRef*r/(r+c.rTop);
+}
+
+// reading of point i at 4096 resolution
+constexpr int16_t adc(const ThermistorCurve &c, int i) {
+  return (int16_t)(adcFromResistance(c, resistance(c, i))+0.5);
+}
+
+constexpr int32_t fineAdc(const ThermistorCurve &c, int i) {
+  return ((int32_t)adc(c, i))<<ADC_FINE_SHIFT;
+}
+
+// step*2^CURVE_RECIPROCAL_BITS/width of segment s, between points s-1 and s.
+constexpr uint16_t reciprocalOf(const ThermistorCurve &c, int32_t width) {
+  return (uint16_t)((((int32_t)c.step<<CURVE_RECIPROCAL_BITS)+width/2)/width);
+}
+
+constexpr uint16_t reciprocal(const ThermistorCurve &c, int s) {
+  return s == 0 ? 0 : reciprocalOf(c, fineAdc(c, s-1)-fineAdc(c, s));
+}
+
+// segment of a fine reading, 0 above the curve, points below it.
+constexpr uint8_t segment(const ThermistorCurve &c, int32_t reading, uint8_t s) {
+  return (s >= c.points || reading > fineAdc(c, s)) ? s : segment(c, reading, s+1);
+}
+
+// segment of the highest reading in coarse bucket i.
+constexpr uint8_t index(const ThermistorCurve &c, int i) {
+  return segment(c, ((int32_t)(i+1)<<CURVE_INDEX_SHIFT)-1, 0);
+}
+
+// Direct lookup, temperature in 0.1C of a reading at 2^bits resolution from the
+// B parameter model, clamped to the curve. Only for NTCs supplied from vRef.
+constexpr int16_t clampDeciC(const ThermistorCurve &c, double deciC) {
+  return deciC < c.min ? c.min
+    : deciC > c.min+c.step*(c.points-1) ? c.min+c.step*(c.points-1)
+    : (int16_t)(deciC < 0 ? deciC-0.5 : deciC+0.5);
+}
+
+constexpr double kelvinFromResistance(const ThermistorCurve &c, double r) {
+  return 1.0/(1.0/c.t0 + log(r/c.r0)/c.b);
+}
+
+constexpr int16_t lookup(const ThermistorCurve &c, int code, uint8_t bits) {
+  return code <= 0 ? c.min+c.step*(c.points-1)
+    : code >= (1<<bits) ? c.min
+    : clampDeciC(c, 10.0*(kelvinFromResistance(c, c.rTop*code/((1<<bits)*c.supply/c.vRef-code))-273.15));
+}
+
+// Compile time integer sequences, built by halving so 4096 entries stays
+// well within the template depth limit.
+template<int... I> struct Indices {};
+template<class A, class B> struct ConcatIndices;
+template<int... A, int... B> struct ConcatIndices<Indices<A...>, Indices<B...> > {
+  typedef Indices<A..., (int)(sizeof...(A))+B...> type;
+};
+template<int N> struct MakeIndices {
+  typedef typename ConcatIndices<typename MakeIndices<N/2>::type, typename MakeIndices<N-N/2>::type>::type type;
+};
+template<> struct MakeIndices<0> { typedef Indices<> type; };
+template<> struct MakeIndices<1> { typedef Indices<0> type; };
+
+} // namespace thermistor
+
+/**
+ * Curve tables for EngineSensors::interpolate, N points.
+ */
+template<int N> struct CurveTables {
+  int16_t table[N];
+  uint16_t reciprocal[N];
+  uint8_t index[CURVE_INDEX_LENGTH];
+};
+
+template<int N, int... P, int... I>
+constexpr CurveTables<N> makeCurveTables(const ThermistorCurve &c, thermistor::Indices<P...>, thermistor::Indices<I...>) {
+  return {{ thermistor::adc(c, P)... }, { thermistor::reciprocal(c, P)... }, { thermistor::index(c, I)... }};
+}
+
+template<int N>
+constexpr CurveTables<N> makeCurveTables(const ThermistorCurve &c) {
+  return makeCurveTables<N>(c, typename thermistor::MakeIndices<N>::type(), typename thermistor::MakeIndices<CURVE_INDEX_LENGTH>::type());
+}
+
+/**
+ * Direct lookup of a B parameter NTC, (1<<BITS)+1 entries in 0.1C so the fine bits
+ * below BITS can interpolate to the next entry without a divide.
+ */
+template<int BITS> struct CurveLookup {
+  int16_t value[(1<<BITS)+1];
+};
+
+template<int BITS, int... I>
+constexpr CurveLookup<BITS> makeCurveLookup(const ThermistorCurve &c, thermistor::Indices<I...>) {
+  return {{ thermistor::lookup(c, I, BITS)... }};
+}
+
+template<int BITS>
+constexpr CurveLookup<BITS> makeCurveLookup(const ThermistorCurve &c) {
+  return makeCurveLookup<BITS>(c, typename thermistor::MakeIndices<(1<<BITS)+1>::type());
+}
+
+#endif
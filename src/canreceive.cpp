@@ -0,0 +1,96 @@
+#include "canreceive.h"
+#include <SPI.h>
+
+
+void CanReceive::begin() {
+  if ( intPin >= 0 ) {
+    pinMode(intPin, INPUT_PULLUP); // INT is open drain, active low
+  }
+  lastService = millis();
+}
+
+/**
+ * Called every loop, reads any received frames and checks for receive buffer overflows.
+ * The overflow flags latch, so overflows between two services count once.
+ */
+void CanReceive::service() {
+  if ( inService ) {
+    return;
+  }
+  processMessages();
+  uint8_t eflg = readRegister(MCP2515_EFLG);
+  if ( (eflg & (MCP2515_EFLG_RX0OVR|MCP2515_EFLG_RX1OVR)) != 0 ) {
+    if ( (eflg & MCP2515_EFLG_RX0OVR) != 0 ) {
+      rx0Overflows++;
+    }
+    if ( (eflg & MCP2515_EFLG_RX1OVR) != 0 ) {
+      rx1Overflows++;
+    }
+    clearFlags(MCP2515_EFLG, MCP2515_EFLG_RX0OVR|MCP2515_EFLG_RX1OVR);
+  }
+}
+
+/**
+ * Called from code that would block the loop, reads received frames when there are any.
+ * Not re-entrant, a message handler that blocks is not serviced again until it returns.
+ */
+void CanReceive::poll() {
+  if ( inService ) {
+    return;
+  }
+  if ( intPin >= 0 && digitalRead(intPin) == HIGH ) {
+    lastService = millis(); // nothing waiting, the gap is not a risk
+    return;
+  }
+  processMessages();
+}
+
+void CanReceive::processMessages() {
+  unsigned long now = millis();
+  unsigned long gap = now - lastService;
+  if ( gap > maxGap ) {
+    maxGap = (gap > 0xffff)?0xffff:gap;
+  }
+  if ( gap > CAN_RECEIVE_LATE_GAP ) {
+    lateServices++;
+  }
+  inService = true;
+  n2k.processMessages();
+  inService = false;
+  lastService = millis();
+}
+
+// Direct register access, the library does not expose the error flags.
+// SPI settings as the MCP_CAN library, the transaction keeps them apart.
+uint8_t CanReceive::readRegister(uint8_t address) {
+  SPI.beginTransaction(SPISettings(10000000, MSBFIRST, SPI_MODE0));
+  digitalWrite(csPin, LOW);
+  SPI.transfer(MCP2515_READ);
+  SPI.transfer(address);
+  uint8_t value = SPI.transfer(0x00);
+  digitalWrite(csPin, HIGH);
+  SPI.endTransaction();
+  return value;
+}
+
+void CanReceive::clearFlags(uint8_t address, uint8_t mask) {
+  SPI.beginTransaction(SPISettings(10000000, MSBFIRST, SPI_MODE0));
+  digitalWrite(csPin, LOW);
+  SPI.transfer(MCP2515_BIT_MODIFY);
+  SPI.transfer(address);
+  SPI.transfer(mask);
+  SPI.transfer(0x00);
+  digitalWrite(csPin, HIGH);
+  SPI.endTransaction();
+}
+
+void CanReceive::dumpStatus() {
+  Serial.print(F("CAN rx    : maxGap:"));
+  Serial.print(maxGap);
+  Serial.print(F(" late:"));
+  Serial.print(lateServices);
+  Serial.print(F(" overflows rx0:"));
+  Serial.print(rx0Overflows);
+  Serial.print(F(" rx1:"));
+  Serial.println(rx1Overflows);
+}
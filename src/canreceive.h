@@ -0,0 +1,46 @@
+#pragma once
+#include <Arduino.h>
+#include "SmallNMEA2000.h"
+
+// ms between services, beyond which the 2 MCP2515 receive buffers may have overflowed on a busy bus.
+#define CAN_RECEIVE_LATE_GAP 20
+
+// MCP2515 SPI instructions and the error flag register, see the MCP2515 datasheet 12.0 and 6.6.
+#define MCP2515_READ 0x03
+#define MCP2515_BIT_MODIFY 0x05
+#define MCP2515_EFLG 0x2D
+#define MCP2515_EFLG_RX0OVR 0x40
+#define MCP2515_EFLG_RX1OVR 0x80
+
+/**
+ * Services the MCP2515 receive buffers through the library processMessages.
+ * service() is called from loop(), poll() from code that would otherwise block the loop
+ * (status dumps, operator input), so requests are read within CAN_RECEIVE_LATE_GAP.
+ * With the MCP2515 INT pin connected poll() only reads over SPI when a frame is waiting.
+ * The gaps between services and the receive buffer overflows latched in EFLG are counted.
+ */
+class CanReceive {
+public:
+    CanReceive(SNMEA2000 &n2k, uint8_t csPin, int8_t intPin = -1) :
+        n2k(n2k),
+        csPin(csPin),
+        intPin(intPin) {};
+    void begin();
+    void service();
+    void poll();
+    void dumpStatus();
+private:
+    void processMessages();
+    uint8_t readRegister(uint8_t address);
+    void clearFlags(uint8_t address, uint8_t mask);
+
+    SNMEA2000 &n2k;
+    uint8_t csPin;
+    int8_t intPin;
+    bool inService = false;
+    unsigned long lastService = 0;
+    uint16_t maxGap = 0;        // ms
+    uint16_t lateServices = 0;  // gaps over CAN_RECEIVE_LATE_GAP
+    uint16_t rx0Overflows = 0;
+    uint16_t rx1Overflows = 0;
+};
@@ -4,15 +4,26 @@
 #include "enginesensors.h"
 #include "SmallNMEA2000.h"
 #include <MemoryFree.h>
+#include "txscheduler.h"
+#include "canreceive.h"
 #ifndef INSPECT_FLASH_USAGE
 #include "oneWireSensors.h"
 #endif
 
-#define RAPID_ENGINE_UPDATE_PERIOD 500
+// transmit periods, slots are spread by the TxScheduler.
+#define RAPID_ENGINE_UPDATE_PERIOD 100
 #define ENGINE_UPDATE_PERIOD 1000
-#define VOLTAGE_UPDATE_PERIOD 999
-#define FUEL_UPDATE_PERIOD 4900
-#define TEMPERATURE_UPDATE_PERIOD 4850
+// engine status is also sent as soon as an alarm is raised or cleared, running or not.
+#define ENGINE_STATUS_MIN_PERIOD 100
+#define VOLTAGE_UPDATE_PERIOD 1000
+// fuel and temperatures are sent on a change beyond the deadband, no more often than
+// the min period, otherwise at the heartbeat period.
+#define FUEL_UPDATE_PERIOD 10000
+#define FUEL_MIN_PERIOD 1000
+#define FUEL_DEADBAND 100 // 0.01%, 1%
+#define TEMPERATURE_UPDATE_PERIOD 5000
+#define TEMPERATURE_MIN_PERIOD 500
+#define TEMPERATURE_DEADBAND 10 // 0.1C, 1C
 
 #define ENGINE_INSTANCE 0
 #define ENGINE_BATTERY_INSTANCE 0
@@ -69,6 +80,11 @@
 #define SNMEA_SPI_CS_PIN 10
 #endif
 
+// MCP2515 INT, not connected on current boards, -1 polls over SPI.
+#ifndef CAN_INT_PIN
+#define CAN_INT_PIN -1
+#endif
+
 
 
 
@@ -83,17 +99,50 @@
 #define FN_DUMP_EVENTS_RESP 12
 #define FN_CLEAR_EVENTS 13
 #define FN_CLEAR_EVENTS_RESP 14
+#define FN_ROUGHNESS 15
+#define ROUGHNESS_UPDATE_PERIOD 5000
 
 
 bool sensorDebug = false;
 bool monitorEnabled = false;
 
-EngineSensors sensors(PIN_FLYWHEEL, 
-    ADC_ALTERNATOR_VOLTAGE,
-    ADC_ENGINEBATTERY,
-    ADC_EXHAUST_NTC1,
-    ADC_ALTERNATOR_NTC2,
-    ADC_ENGINEROOM_NTC3);
+// Sensor channels, adding a sensor is a new entry here and a SENSOR_x id.
+// the engine battery is also the coolant supply, the coolant is sampled as a ratiometric pair with it
+// so that ripple on the 12V rail cancels in the ratio.
+const SensorChannel sensorChannels[] PROGMEM = {
+  // id, pin, conversion, reference, filter, accumulate, sampleDuration, viaPga,
+  //   curve, offset, scale, shift, minMv, maxValue, limit, pgn, instance, source
+  { SENSOR_ALTERNATOR_VOLTAGE, ADC_ALTERNATOR_VOLTAGE, CONVERSION_LINEAR_VDD, SENSOR_NONE,
+      ADC_FILTER_VOLTAGE, ADC_ACCUMULATE_VOLTAGE, ADC_SAMPDUR_VOLTAGE, ADC_PGA,
+      // mV
+      NULL, 0, SENSOR_SCALE(VOLTAGE_SCALE, 12), 12, -1, INT32_MAX, INT32_MAX, 127508L, ALTERNATOR_BATTERY_INSTANCE, 0 },
+  { SENSOR_ENGINE_BATTERY_VOLTAGE, ADC_ENGINEBATTERY, CONVERSION_LINEAR_VDD, SENSOR_NONE,
+      ADC_FILTER_COOLANT, ADC_ACCUMULATE_COOLANT, ADC_SAMPDUR_COOLANT, ADC_PGA,
+      NULL, 0, SENSOR_SCALE(VOLTAGE_SCALE, 12), 12, -1, INT32_MAX, INT32_MAX, 127508L, ENGINE_BATTERY_INSTANCE, 0 },
+  { SENSOR_COOLANT_TEMPERATURE, ADC_COOLANT_TEMPERATURE, CONVERSION_RATIOMETRIC_NTC, SENSOR_ENGINE_BATTERY_VOLTAGE,
+      ADC_FILTER_COOLANT, ADC_ACCUMULATE_COOLANT, ADC_SAMPDUR_COOLANT, false,
+      &coolantCurve, 0, 0, 0, 0, 0, 0, 127489L, ENGINE_INSTANCE, 0 },
+  { SENSOR_EXHAUST_TEMPERATURE, ADC_EXHAUST_NTC1, CONVERSION_NTC, SENSOR_NONE,
+      ADC_FILTER_NTC, ADC_ACCUMULATE_NTC, ADC_SAMPDUR_NTC, false,
+      &ntcCurveNMF5210K, 0, 0, 0, 0, 0, 0, 130316L, 0, 14 },
+  { SENSOR_ALTERNATOR_TEMPERATURE, ADC_ALTERNATOR_NTC2, CONVERSION_NTC, SENSOR_NONE,
+      ADC_FILTER_NTC, ADC_ACCUMULATE_NTC, ADC_SAMPDUR_NTC, false,
+      // custom temperature source, 0-15 are defined.
+      &ntcCurveNMF5210K, 0, 0, 0, 0, 0, 0, 130316L, 0, 30 },
+  { SENSOR_ENGINEROOM_TEMPERATURE, ADC_ENGINEROOM_NTC3, CONVERSION_NTC, SENSOR_NONE,
+      ADC_FILTER_NTC, ADC_ACCUMULATE_NTC, ADC_SAMPDUR_NTC, false,
+      &ntcCurveNMF5210K, 0, 0, 0, 0, 0, 0, 130316L, 0, 3 },
+  { SENSOR_OIL_PRESSURE, ADC_OIL_SENSOR, CONVERSION_LINEAR_VDD, SENSOR_NONE,
+      ADC_FILTER_OIL, ADC_ACCUMULATE_SENDER, ADC_SAMPDUR_SENDER, false,
+      // Pa, below PSIV_POWEROFF disconnected or not powered up.
+      NULL, SENSOR_MV(PSIV_0), SENSOR_SCALE(SCALE_TO_PA/1000.0, 8), 8, SENSOR_MV(PSIV_POWEROFF), INT32_MAX, INT32_MAX, 127489L, ENGINE_INSTANCE, 0 },
+  { SENSOR_FUEL_LEVEL, ADC_FUEL_SENSOR, CONVERSION_LINEAR_5V, SENSOR_NONE,
+      ADC_FILTER_FUEL, ADC_ACCUMULATE_SENDER, ADC_SAMPDUR_SENDER, false,
+      // 0.01%, resistances may be out of spec, > 200% is disconnected.
+      NULL, 0, SENSOR_SCALE(SCALE_FUEL_TO_PERCENT/10.0, 12), 12, -1, 20000, 10000, 127505L, FUEL_LEVEL_INSTANCE, FUEL_TYPE }
+};
+
+EngineSensors sensors(PIN_FLYWHEEL, sensorChannels, sizeof(sensorChannels)/sizeof(SensorChannel));
 
 
 const SNMEA2000ProductInfo productInfomation PROGMEM={
@@ -113,18 +162,25 @@ const SNMEA2000ConfigInfo configInfo PROGMEM={
 };
 
 
+// periods as txSchedule.
 const unsigned long txPGN[] = { 
-    127488L, // Rapid engine ideally 0.1s
-    127489L, // Dynamic engine 0.5s
-    127505L, // Tank Level 2.5s
-    130316L, // Extended Temperature 2.5s
-    127508L,
+    127488L, // Rapid engine 0.1s while running
+    127489L, // Dynamic engine 1s while running, and on a status change
+    127505L, // Tank Level on change, 10s heartbeat
+    130316L, // Extended Temperature on change, 5s heartbeat
+    127493L, // Transmission, exhaust temperature with 130316
+    127508L, // Battery status 1s
+    ENGINE_PROPRIETARY_PGN, // roughness 5s with TOOTH_PERIODS, event responses
+    ENGINE_PROPRIETARY_FP_PGN, // event dump response
   SNMEA200_DEFAULT_TX_PGN
 };
 
 const unsigned long rxPGN[] = { 
   ENGINE_PROPRIETARY_PGN,
   ENGINE_PROPRIETARY_FP_PGN,
+#ifdef CLOCK_CALIBRATION
+  126992L, // System time, reference for the CPU clock
+#endif
   SNMEA200_DEFAULT_RX_PGN
 };
 
@@ -141,11 +197,13 @@ EngineMonitor engineMonitor = EngineMonitor(DEVICE_ADDRESS,
   &productInfomation, 
   &configInfo, 
   &txPGN[0],
-  SNMEA200_DEFAULT_TX_PGN_LEN+5,
+  sizeof(txPGN)/sizeof(txPGN[0]),
   &rxPGN[0],
-  SNMEA200_DEFAULT_RX_PGN_LEN+2,
+  sizeof(rxPGN)/sizeof(rxPGN[0]),
   SNMEA_SPI_CS_PIN);
 
+CanReceive canReceive(engineMonitor, SNMEA_SPI_CS_PIN, CAN_INT_PIN);
+
 #ifndef INSPECT_FLASH_USAGE
 OneWire oneWire;
 OneWireSensors oneWireSensor(oneWire);
@@ -187,130 +245,230 @@ void blinkLed(int n){};
 
 
 
+// Snapshot values last sent, by sensor id, for the deadbands, and the status last
+// sent in 127489 and with the temperatures.
+int32_t sentValue[SENSOR_CHANNELS];
+uint16_t sentEngineStatus1 = 0;
+uint16_t sentEngineStatus2 = 0;
+uint16_t sentTemperatureStatus1 = 0;
+uint16_t sentTemperatureStatus2 = 0;
+
+/**
+ * True if a sensor value has moved beyond the deadband since it was last sent,
+ * or has become available or unavailable.
+ */
+bool changedBeyond(const EngineSnapshot &engine, uint8_t id, int32_t deadband) {
+  int32_t value = engine.value[id];
+  int32_t sent = sentValue[id];
+  if ( value == SENSOR_NA || sent == SENSOR_NA ) {
+    return value != sent;
+  }
+  int32_t change = value-sent;
+  return change > deadband || change < -deadband;
+}
+
 /**
  * Send engine rapid updates while the engine is running.
  */ 
-void sendRapidEngineData() {
-  static unsigned long lastRapidEngineUpdate=0;
-  if ( sensors.isEngineRunning() ) {
-    unsigned long now = millis();
-    if ( now-lastRapidEngineUpdate > RAPID_ENGINE_UPDATE_PERIOD ) {
-      lastRapidEngineUpdate = now;
-      toggleLed();
-      engineMonitor.sendRapidEngineDataMessage(ENGINE_INSTANCE, sensors.getEngineRPM());
-    }
+bool sendRapidEngineData() {
+  const EngineSnapshot &engine = sensors.getSnapshot();
+  if ( engine.engineRunning ) {
+    toggleLed();
+    engineMonitor.sendRapidEngineDataMessage(ENGINE_INSTANCE, engine.engineRPM);
   }
+  return true;
 }
 
 
 /**
- * Send engine status while the engine is running.
+ * An alarm raised or cleared since 127489 was last sent.
+ */
+bool engineStatusChanged() {
+  const EngineSnapshot &engine = sensors.getSnapshot();
+  return engine.status1 != sentEngineStatus1 || engine.status2 != sentEngineStatus2;
+}
+
+/**
+ * Send engine status while the engine is running, and when the status has changed.
+ * The alarms active when the engine stops are held until the next start, so an alarm
+ * raised just before the RPM falls is still sent.
  */ 
-void sendEngineData() {
-  static unsigned long lastEngineUpdate=0;
-  if ( sensors.isEngineRunning() ) {
-    unsigned long now = millis();
-    if ( now-lastEngineUpdate > ENGINE_UPDATE_PERIOD ) {
-      lastEngineUpdate = now;
-      toggleLed();
-      double engineSeconds = sensors.getEngineSeconds();
-      double coolantTemperature = sensors.getCoolantTemperatureK(ADC_COOLANT_TEMPERATURE, ADC_ENGINEBATTERY);
-      double alternatorVoltage = sensors.getVoltage(ADC_ALTERNATOR_VOLTAGE);
-      double oilPressure = sensors.getOilPressure(ADC_OIL_SENSOR);
-      double alternatorTemperature = sensors.getTemperatureK(ADC_ALTERNATOR_NTC2);
-      double exhaustTemperature = sensors.getTemperatureK(ADC_EXHAUST_NTC1);
-
-
-
-      uint16_t status1 = sensors.getEngineStatus1();
-      uint16_t status2 = sensors.getEngineStatus2();
-      if (status1 != 0) {
-        sensors.dumpEngineStatus1();
-      }
-      if (status2 != 0) {
-        sensors.dumpEngineStatus2();
-      }
-      engineMonitor.sendEngineDynamicParamMessage(ENGINE_INSTANCE,
-          engineSeconds,
-          coolantTemperature,
-          alternatorVoltage,
-          status1, // status1
-          status2, // status2
-          oilPressure, // engineOilPressure
-          alternatorTemperature // alterator temperature as engineOil temperature, more important with LiFeP04
-          );
+bool sendEngineData() {
+  const EngineSnapshot &engine = sensors.getSnapshot();
+  if ( engine.engineRunning || engineStatusChanged() ) {
+    toggleLed();
+    sentEngineStatus1 = engine.status1;
+    sentEngineStatus2 = engine.status2;
+    if (engine.status1 != 0) {
+      sensors.dumpEngineStatus1();
     }
+    if (engine.status2 != 0) {
+      sensors.dumpEngineStatus2();
+    }
+    engineMonitor.sendEngineDynamicParamMessage(ENGINE_INSTANCE,
+        engine.engineSeconds,
+        engine.getTemperatureK(SENSOR_COOLANT_TEMPERATURE),
+        engine.getVoltage(SENSOR_ALTERNATOR_VOLTAGE),
+        engine.status1, // status1
+        engine.status2, // status2
+        engine.getPressure(SENSOR_OIL_PRESSURE), // engineOilPressure
+        engine.getTemperatureK(SENSOR_ALTERNATOR_TEMPERATURE) // alterator temperature as engineOil temperature, more important with LiFeP04
+#ifdef ENGINE_LOAD_ESTIMATE
+        , engine.fuelRate, // l/h estimated
+        SNMEA2000::n2kDoubleNA, // coolant pressure
+        SNMEA2000::n2kDoubleNA, // fuel pressure
+        (int8_t)(engine.engineLoad+0.5) // % estimated
+#endif
+        );
   }
+  return true;
 }
 
 /**
- * Send voltages all the time.
+ * Send voltages all the time, one battery per call.
  */ 
-void sendVoltages() {
-  static unsigned long lastVoltageUpdate=0;
+bool sendVoltages() {
   static byte sid = 0;
-  unsigned long now = millis();
-  if ( now-lastVoltageUpdate > VOLTAGE_UPDATE_PERIOD ) {
-    lastVoltageUpdate = now;
-      toggleLed();
-    // because the engine monitor is not on all the time, the sid and instance ids of these messages has been shifted
-    // to make space for sensors that are on all the time, and would be used by default
-    // engineMonitor.sendDCBatterStatusMessage(SERVICE_BATTERY_INSTANCE, sid, sensors.getServiceBatteryVoltage());
-    engineMonitor.sendDCBatterStatusMessage(ENGINE_BATTERY_INSTANCE, sid, sensors.getVoltage(ADC_ENGINEBATTERY));
-    engineMonitor.sendDCBatterStatusMessage(ALTERNATOR_BATTERY_INSTANCE, sid, 
-        sensors.getVoltage(ADC_ALTERNATOR_VOLTAGE),
-        sensors.getTemperatureK(ADC_ALTERNATOR_NTC2)
-        );
-    sid++;
+  static bool alternator = false;
+  const EngineSnapshot &engine = sensors.getSnapshot();
+  // because the engine monitor is not on all the time, the sid and instance ids of these messages has been shifted
+  // to make space for sensors that are on all the time, and would be used by default
+  // engineMonitor.sendDCBatterStatusMessage(SERVICE_BATTERY_INSTANCE, sid, sensors.getServiceBatteryVoltage());
+  if ( !alternator ) {
+    toggleLed();
+    engineMonitor.sendDCBatterStatusMessage(ENGINE_BATTERY_INSTANCE, sid, engine.getVoltage(SENSOR_ENGINE_BATTERY_VOLTAGE));
+    alternator = true;
+    return false;
   }
+  engineMonitor.sendDCBatterStatusMessage(ALTERNATOR_BATTERY_INSTANCE, sid, 
+      engine.getVoltage(SENSOR_ALTERNATOR_VOLTAGE),
+      engine.getTemperatureK(SENSOR_ALTERNATOR_TEMPERATURE)
+      );
+  alternator = false;
+  sid++;
+  return true;
 }
 
 /**
  * send Fuel all the time.
  */ 
-void sendFuel() {
-  static unsigned long lastFuelUpdate=0;
-  unsigned long now = millis();
-  if ( now-lastFuelUpdate > FUEL_UPDATE_PERIOD ) {
-    lastFuelUpdate = now;
-      toggleLed();
-    engineMonitor.sendFluidLevelMessage(FUEL_TYPE, FUEL_LEVEL_INSTANCE, sensors.getFuelLevel(ADC_FUEL_SENSOR), sensors.getFuelCapacity());
-  }
+bool sendFuel() {
+  toggleLed();
+  sentValue[SENSOR_FUEL_LEVEL] = sensors.getSnapshot().value[SENSOR_FUEL_LEVEL];
+  engineMonitor.sendFluidLevelMessage(FUEL_TYPE, FUEL_LEVEL_INSTANCE, sensors.getSnapshot().getPercent(SENSOR_FUEL_LEVEL), sensors.getFuelCapacity());
+  return true;
+}
+
+bool fuelChanged() {
+  return changedBeyond(sensors.getSnapshot(), SENSOR_FUEL_LEVEL, FUEL_DEADBAND);
 }
 
 /**
- * send temperatures all the time.
+ * send temperatures all the time, one message per call, the sensor channels on 130316,
+ * the exhaust as transmission oil then the one wire sensors.
  */ 
-void sendTemperatures() {
-  static unsigned long lastTempUpdate=0;
+bool sendTemperatures() {
   static byte sid = 0;
-  unsigned long now = millis();
-  if ( now-lastTempUpdate > TEMPERATURE_UPDATE_PERIOD ) {
-    lastTempUpdate = now;    
-      toggleLed();
-    // this may need adjusting depending on what the instruments can display
-    double exhaustTemperature = sensors.getTemperatureK(ADC_EXHAUST_NTC1);
-    engineMonitor.sendTemperatureMessage(sid, 0, 14, exhaustTemperature);
+  static uint8_t message = 0;
+  const EngineSnapshot &engine = sensors.getSnapshot();
+  uint8_t nChannels = sensors.getChannelCount();
+  if ( message == 0 ) {
+    toggleLed();
+    sentTemperatureStatus1 = engine.status1;
+    sentTemperatureStatus2 = engine.status2;
+  }
+  // this may need adjusting depending on what the instruments can display
+  SensorChannel channel;
+  while ( message < nChannels ) {
+    sensors.getChannel(message++, channel);
+    if ( channel.pgn == 130316L ) {
+      sentValue[channel.id] = engine.value[channel.id];
+      engineMonitor.sendTemperatureMessage(sid, channel.instance, channel.source, engine.getTemperatureK(channel.id));
+      return false;
+    }
+  }
+  if ( message == nChannels ) {
+    message++;
     // abusing transmission information so exhaust temp can be shown on an i70 display
     engineMonitor.sendTransmissionDynamicParamMessage(ENGINE_INSTANCE,
         0x03, // invalid transmssionGear,
         -1E9, //transmssionOilPressure,
-        exhaustTemperature,
+        engine.getTemperatureK(SENSOR_EXHAUST_TEMPERATURE),
         0x00); // transmissionStatus
-    engineMonitor.sendTemperatureMessage(sid, 0, 3, sensors.getTemperatureK(ADC_ENGINEROOM_NTC3));
-    // custom temperatures
-    // temperature source can be 0-255, 0-15 are defined.
-    engineMonitor.sendTemperatureMessage(sid, 0, 30, sensors.getTemperatureK(ADC_ALTERNATOR_NTC2));
+    return false;
+  }
 
 #ifndef INSPECT_FLASH_USAGE
-    uint8_t maxActiveDevices = oneWireSensor.getMaxActiveDevice();
-    for (int i = 0; i < maxActiveDevices; i++) {
-      engineMonitor.sendTemperatureMessage(sid, 0, 31+i, oneWireSensor.getTemperatureK(i));
-    }
+  uint8_t device = message-nChannels-1;
+  if ( device < oneWireSensor.getMaxActiveDevice() ) {
+    message++;
+    engineMonitor.sendTemperatureMessage(sid, 0, 31+device, oneWireSensor.getTemperatureK(device));
+    return false;
+  }
 #endif
-    sid++;
+  // the call after the last message sends nothing and ends the period.
+  message = 0;
+  sid++;
+  return true;
+}
+
+/**
+ * A 130316 sensor channel beyond the deadband or an alarm raised or cleared.
+ * One wire sensors are only sent on the heartbeat.
+ */
+bool temperaturesChanged() {
+  const EngineSnapshot &engine = sensors.getSnapshot();
+  if ( engine.status1 != sentTemperatureStatus1 || engine.status2 != sentTemperatureStatus2 ) {
+    return true;
+  }
+  SensorChannel channel;
+  for (uint8_t i = 0; i < sensors.getChannelCount(); i++) {
+    sensors.getChannel(i, channel);
+    if ( channel.pgn == 130316L && changedBeyond(engine, channel.id, TEMPERATURE_DEADBAND) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+#ifdef TOOTH_PERIODS
+/**
+ * Broadcast the flywheel roughness while the engine is running, see README.
+ */
+bool sendRoughness() {
+  uint16_t roughness, imbalance;
+  uint8_t revolutions;
+  if ( sensors.getRoughness(roughness, imbalance, revolutions) ) {
+    MessageHeader messageHeader(ENGINE_PROPRIETARY_PGN, 6, engineMonitor.getAddress(), 0xff); // broadcast
+    engineMonitor.startPacket(&messageHeader);
+    engineMonitor.output2ByteUInt(ENGINE_PROPRIETARY_CODE);
+    engineMonitor.outputByte(FN_ROUGHNESS);
+    engineMonitor.outputByte(revolutions);
+    engineMonitor.output2ByteUInt(roughness);
+    engineMonitor.output2ByteUInt(imbalance);
+    engineMonitor.finishPacket();
   }
+  return true;
 }
+#endif
+
+// Transmit schedule, adding a PGN is an entry here and in txPGN.
+// In priority order, highest first. Senders that only send while the engine is running
+// check the snapshot.
+const TxScheduleEntry txSchedule[] PROGMEM = {
+  // pgn, period ms, sender, min period ms, changed
+  { 127488L, RAPID_ENGINE_UPDATE_PERIOD, sendRapidEngineData, 0, NULL },
+  { 127489L, ENGINE_UPDATE_PERIOD, sendEngineData, ENGINE_STATUS_MIN_PERIOD, engineStatusChanged },
+  { 127508L, VOLTAGE_UPDATE_PERIOD, sendVoltages, 0, NULL },
+  { 127505L, FUEL_UPDATE_PERIOD, sendFuel, FUEL_MIN_PERIOD, fuelChanged },
+#ifdef TOOTH_PERIODS
+  { ENGINE_PROPRIETARY_PGN, ROUGHNESS_UPDATE_PERIOD, sendRoughness, 0, NULL },
+#endif
+  { 130316L, TEMPERATURE_UPDATE_PERIOD, sendTemperatures, TEMPERATURE_MIN_PERIOD, temperaturesChanged },
+};
+
+TxScheduler txScheduler(txSchedule, sizeof(txSchedule)/sizeof(TxScheduleEntry));
 
 
 void printN2K(double v, double fact, double offset, const char * term="\n") {
@@ -325,20 +483,59 @@ void printN2K(double v, double fact, double offset, const char * term="\n") {
 
 // uses 1.1KB
 void showStatus() {
+  // with sensor debug, convert now so the conversions are output.
+  if ( sensorDebug ) {
+    sensors.updateSnapshot(true);
+  }
+  const EngineSnapshot &engine = sensors.getSnapshot();
   Serial.print(F("CPU Vdd   : "));Serial.println(sensors.getStoredVddVoltage());
   Serial.print(F("Free mem  : "));Serial.println(freeMemory());
-  Serial.print(F("Exhaust T : "));printN2K(sensors.getTemperatureK(ADC_EXHAUST_NTC1, sensorDebug), 1.0,273.15);
-  Serial.print(F("Alt T     : "));printN2K(sensors.getTemperatureK(ADC_ALTERNATOR_NTC2, sensorDebug),1.0, 273.15);
-  Serial.print(F("Room T    : "));printN2K(sensors.getTemperatureK(ADC_ENGINEROOM_NTC3, sensorDebug),1.0,273.15);
-  Serial.print(F("Fuel      : "));printN2K(sensors.getFuelLevel(ADC_FUEL_SENSOR, sensorDebug),1.0,0);
-  Serial.print(F("Engine V  : "));printN2K(sensors.getVoltage(ADC_ENGINEBATTERY, sensorDebug),1.0,0);
-  Serial.print(F("Alt V     : "));printN2K(sensors.getVoltage(ADC_ALTERNATOR_VOLTAGE, sensorDebug),1.0,0);
-  Serial.print(F("Engine h  : "));Serial.println(sensors.getEngineSeconds()/3600.0);
-  Serial.print(F("Coolant T : "));printN2K(sensors.getCoolantTemperatureK(ADC_COOLANT_TEMPERATURE, ADC_ENGINEBATTERY, sensorDebug),1.0,273.15);
-  Serial.print(F("Oil Psi   : "));printN2K(sensors.getOilPressure(ADC_OIL_SENSOR, sensorDebug),1.0/6894.76,0.0);
+  Serial.print(F("ADC conv  : "));Serial.println(sensors.adcSampler.getConversions());
+  Serial.print(F("Snapshot  : "));Serial.print(millis()-engine.timestamp);Serial.print(F("ms valid:0x"));Serial.println(engine.valid,HEX);
+  Serial.print(F("Exhaust T : "));printN2K(engine.getTemperatureK(SENSOR_EXHAUST_TEMPERATURE), 1.0,273.15);
+  Serial.print(F("Alt T     : "));printN2K(engine.getTemperatureK(SENSOR_ALTERNATOR_TEMPERATURE),1.0, 273.15);
+  Serial.print(F("Room T    : "));printN2K(engine.getTemperatureK(SENSOR_ENGINEROOM_TEMPERATURE),1.0,273.15);
+  Serial.print(F("Fuel      : "));printN2K(engine.getPercent(SENSOR_FUEL_LEVEL),1.0,0);
+  Serial.print(F("Engine V  : "));printN2K(engine.getVoltage(SENSOR_ENGINE_BATTERY_VOLTAGE),1.0,0);
+  Serial.print(F("Alt V     : "));printN2K(engine.getVoltage(SENSOR_ALTERNATOR_VOLTAGE),1.0,0);
+  Serial.print(F("Engine h  : "));Serial.println(engine.engineSeconds/3600.0);
+  Serial.print(F("Coolant T : "));printN2K(engine.getTemperatureK(SENSOR_COOLANT_TEMPERATURE),1.0,273.15);
+  Serial.print(F("Oil Psi   : "));printN2K(engine.getPressure(SENSOR_OIL_PRESSURE),1.0/6894.76,0.0);
+  canReceive.poll();
   sensors.read(sensorDebug);
-  Serial.print(F("Engine On : "));Serial.println(sensors.isEngineRunning()?"Y":"N");
-  Serial.print(F("Engine RPM: "));printN2K(sensors.getEngineRPM(),1.0,0);
+  Serial.print(F("Engine On : "));Serial.println(engine.engineRunning?"Y":"N");
+  Serial.print(F("Engine RPM: "));printN2K(engine.engineRPM,1.0,0);
+  const FrequencyCapture &capture = sensors.getFrequencyCapture();
+  Serial.print(F("RPM Hz    : "));Serial.print(capture.frequency,3);
+  Serial.print(F(" confidence:"));Serial.print(capture.confidence);
+  Serial.print(F(" samples:"));Serial.print(capture.samples);
+  Serial.print(F(" isr:"));Serial.print(capture.isrCalls);
+  Serial.print(F(" rejected:"));Serial.println(capture.rejected);
+#ifdef ENGINE_LOAD_ESTIMATE
+  Serial.print(F("Load      : "));Serial.print(engine.engineLoad);
+  Serial.print(F("% fuel l/h:"));Serial.print(engine.fuelRate);
+  Serial.print(F(" used l:"));Serial.println(engine.fuelUsed);
+  if ( engine.tankChecked ) {
+    Serial.print(F("Tank used : "));Serial.print(engine.tankUsed);
+    Serial.print(F(" l estimated:"));Serial.println(engine.tankEstimatedUsed);
+  }
+#endif
+#ifdef CLOCK_CALIBRATION
+  Serial.print(F("Clock     : "));Serial.print(sensors.clockCalibration.correction,5);
+  Serial.print(F(" measurements:"));Serial.print(sensors.clockCalibration.measurements);
+  Serial.print(F(" source:"));Serial.println(sensors.clockCalibration.referenceSource);
+#endif
+#ifdef ALTERNATOR_W_TERMINAL
+  const FrequencyCapture &wTerminal = sensors.getAlternatorCapture();
+  Serial.print(F("W Hz      : "));Serial.print(wTerminal.frequency,3);
+  Serial.print(F(" confidence:"));Serial.print(wTerminal.confidence);
+  Serial.print(F(" ratio:"));Serial.print(sensors.localStorage.alternatorRatio,4);
+  Serial.print(F(" rpmSensors:0x"));Serial.println(engine.rpmSensors,HEX);
+#endif
+#ifdef TOOTH_PERIODS
+  sensors.dumpToothProfile();
+#endif
+  canReceive.poll();
 #ifndef INSPECT_FLASH_USAGE
   uint8_t maxActiveDevices = oneWireSensor.getMaxActiveDevice();
   Serial.print(F("Onewire N : "));Serial.println(maxActiveDevices);
@@ -350,19 +547,18 @@ void showStatus() {
   }
 #endif
   engineMonitor.dumpStatus();
+  canReceive.dumpStatus();
+  canReceive.poll();
+  txScheduler.dumpStatus();
+  canReceive.poll();
 
 
-  Serial.print(F("ADC_EXH  : "));sensors.dumpADC(ADC_EXHAUST_NTC1);
-  Serial.print(F("ADC_ALT  : "));sensors.dumpADC(ADC_ALTERNATOR_NTC2);
-  Serial.print(F("ADC_ROOM : "));sensors.dumpADC(ADC_ENGINEROOM_NTC3);
-  Serial.print(F("ADC_ALT_V: "));sensors.dumpADC(ADC_ALTERNATOR_VOLTAGE);
-  Serial.print(F("ADC_FUEL : "));sensors.dumpADC(ADC_FUEL_SENSOR);
-  Serial.print(F("ADC_OIL  : "));sensors.dumpADC(ADC_OIL_SENSOR);
-  Serial.print(F("ADC_COOL : "));sensors.dumpADC(ADC_COOLANT_TEMPERATURE);
-  Serial.print(F("ADC_BAT  : "));sensors.dumpADC(ADC_ENGINEBATTERY);
+  sensors.dumpADCs();
+  canReceive.poll();
 
   sensors.dumpEngineStatus1();
   sensors.dumpEngineStatus2();
+  canReceive.poll();
 
   // dump the stored events
   uint32_t lastEvent = 0;
@@ -377,6 +573,7 @@ void showStatus() {
     Serial.print(eventId);
     Serial.print(F(" h:"));
     Serial.println(0.004166666667*lastEvent);
+    canReceive.poll();
   }
 
 
@@ -388,24 +585,34 @@ void monitor() {
     unsigned long now = millis();
     if ( now-lastMonitorOutput > 1000 ) {
       lastMonitorOutput = now;
+      const EngineSnapshot &engine = sensors.getSnapshot();
       Serial.print("rpm=");
-      printN2K(sensors.getEngineRPM(),1.0,0,",");
+      printN2K(engine.engineRPM,1.0,0,",");
+      Serial.print(" rpm/s=");
+      printN2K(engine.engineRPMRate,1.0,0,",");
+#ifdef ENGINE_LOAD_ESTIMATE
+      Serial.print(" load=");
+      printN2K(engine.engineLoad,1.0,0,",");
+      Serial.print(" l/h=");
+      printN2K(engine.fuelRate,1.0,0,",");
+#endif
       Serial.print(" coolant=");
-      printN2K(sensors.getCoolantTemperatureK(ADC_COOLANT_TEMPERATURE, ADC_ENGINEBATTERY, false),1.0, 273.15, ",");
+      printN2K(engine.getTemperatureK(SENSOR_COOLANT_TEMPERATURE),1.0, 273.15, ",");
       Serial.print(" oil=");
-      printN2K(sensors.getOilPressure(ADC_OIL_SENSOR, false),1.0/6894.76,0.0, ",");
+      printN2K(engine.getPressure(SENSOR_OIL_PRESSURE),1.0/6894.76,0.0, ",");
       Serial.print(" fuel=");
-      printN2K(sensors.getFuelLevel(ADC_FUEL_SENSOR, false),1.0, 0.0, ",");
+      printN2K(engine.getPercent(SENSOR_FUEL_LEVEL),1.0, 0.0, ",");
+      canReceive.poll();
       Serial.print(" batV=");
-      printN2K(sensors.getVoltage(ADC_ENGINEBATTERY, false), 1.0, 0.0, ",");
+      printN2K(engine.getVoltage(SENSOR_ENGINE_BATTERY_VOLTAGE), 1.0, 0.0, ",");
       Serial.print(" altV=");
-      printN2K(sensors.getVoltage(ADC_ALTERNATOR_VOLTAGE, false),1.0, 0.0, ",");
+      printN2K(engine.getVoltage(SENSOR_ALTERNATOR_VOLTAGE),1.0, 0.0, ",");
       Serial.print(" exT=");
-      printN2K(sensors.getTemperatureK(ADC_EXHAUST_NTC1, false), 1.0, 273.15, ",");
+      printN2K(engine.getTemperatureK(SENSOR_EXHAUST_TEMPERATURE), 1.0, 273.15, ",");
       Serial.print(" altT=");
-      printN2K(sensors.getTemperatureK(ADC_ALTERNATOR_NTC2, false),1.0, 273.15, ",");
+      printN2K(engine.getTemperatureK(SENSOR_ALTERNATOR_TEMPERATURE),1.0, 273.15, ",");
       Serial.print(" erT=");
-      printN2K(sensors.getTemperatureK(ADC_ENGINEROOM_NTC3, false),1.0, 273.15);
+      printN2K(engine.getTemperatureK(SENSOR_ENGINEROOM_TEMPERATURE),1.0, 273.15);
     }
   }
 }
@@ -413,11 +620,30 @@ void monitor() {
 
 void(* resetDevice) (void) = 0; //declare reset function @ address 0
 
+/**
+ * Read a line typed at the monitor, up to 10s, servicing CAN receive while waiting.
+ */
+size_t readLine(char *buffer, size_t len) {
+  size_t l = 0;
+  unsigned long start = millis();
+  while ( millis()-start < 10000 ) {
+    canReceive.poll();
+    if ( Serial.available() ) {
+      char chr = Serial.read();
+      if ( chr == '\n' ) {
+        break;
+      } else if ( l < len ) {
+        buffer[l++] = chr;
+      }
+    }
+  }
+  return l;
+}
+
 void setEngineHours() {
-  Serial.setTimeout(10000);
   Serial.print(F("Engine Hours ?>"));
   char buffer[10];
-  size_t l = Serial.readBytesUntil('\n', buffer, 9);
+  size_t l = readLine(buffer, 9);
   if ( l > 0) {
     buffer[l] = '\0';
     double hours = atof(buffer);
@@ -428,14 +654,12 @@ void setEngineHours() {
     Serial.println("");
     Serial.println(F("canceled"));
   }
-  Serial.setTimeout(100);
 }
 
 void setStoredVddVoltage() {
-  Serial.setTimeout(10000);
   Serial.print(F("Vdd Voltage ?>"));
   char buffer[10];
-  size_t l = Serial.readBytesUntil('\n', buffer, 9);
+  size_t l = readLine(buffer, 9);
   if ( l > 0) {
     buffer[l] = '\0';
     double measuredVoltagee = atof(buffer);
@@ -446,7 +670,6 @@ void setStoredVddVoltage() {
     Serial.println("");
     Serial.println(F("canceled"));
   }
-  Serial.setTimeout(100);
 }
 
 void toggleDiagnostics() {
@@ -522,6 +745,16 @@ void checkCommand() {
 
 
 void messageHandler(MessageHeader *requestMessageHeader, byte * buffer, int len) {
+#ifdef CLOCK_CALIBRATION
+  if ( requestMessageHeader->pgn == 126992L && len >= 8 ) { // system time, seconds since midnight at byte 4 in 0.0001s
+    unsigned long now = micros();
+    uint32_t timeOfDay = (((uint32_t)buffer[7])<<24)|(((uint32_t)buffer[6])<<16)|(((uint32_t)buffer[5])<<8)|(buffer[4]);
+    if ( timeOfDay != 0xffffffff ) {
+      sensors.clockCalibration.reference(requestMessageHeader->source, timeOfDay, now);
+    }
+    return;
+  }
+#endif
   if ( requestMessageHeader->pgn == ENGINE_PROPRIETARY_PGN) { // single packet pro[prietary]
 
     uint16_t id = (((unsigned long )buffer[2])<<16)|(((unsigned long )buffer[1])<<8)|(buffer[0]);
@@ -595,6 +828,8 @@ void setup() {
   oneWireSensor.begin();
 #endif
   blinkLed(4);
+  canReceive.begin();
+  txScheduler.begin();
 
   Serial.println(F("Running..."));;
 }
@@ -606,12 +841,8 @@ void loop() {
 #ifndef INSPECT_FLASH_USAGE  
   oneWireSensor.readOneWire();
 #endif
-  sendRapidEngineData();
-  sendEngineData();
-  sendVoltages();
-  sendTemperatures();
-  sendFuel();
-  engineMonitor.processMessages();
+  txScheduler.run();
+  canReceive.service();
   checkCommand();
 }
 
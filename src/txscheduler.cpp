@@ -0,0 +1,74 @@
+#include "txscheduler.h"
+
+
+void TxScheduler::begin() {
+  if ( nEntries > TX_SCHEDULER_MAX_ENTRIES ) {
+    nEntries = TX_SCHEDULER_MAX_ENTRIES;
+  }
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < nEntries; i++) {
+    state[i].nextDue = now + (i+1)*TX_SCHEDULER_SLOT;
+  }
+}
+
+void TxScheduler::run() {
+  unsigned long now = millis();
+  // entries are in priority order, the first due or changed is sent.
+  TxScheduleEntry entry;
+  uint8_t due = 0;
+  long late = 0;
+  bool changed = false;
+  for (; due < nEntries; due++) {
+    late = (long)(now - state[due].nextDue);
+    if ( state[due].sending || late >= 0 ) {
+      break;
+    }
+    memcpy_P(&entry, &entries[due], sizeof(TxScheduleEntry));
+    // the last send was at nextDue-period.
+    if ( entry.changed != NULL && late+(long)entry.period >= (long)entry.minPeriod && entry.changed() ) {
+      changed = true;
+      break;
+    }
+  }
+  if ( due == nEntries ) {
+    return;
+  }
+  memcpy_P(&entry, &entries[due], sizeof(TxScheduleEntry));
+  TxScheduleState &s = state[due];
+  if ( changed ) {
+    // the heartbeat restarts from the change.
+    s.nextDue = now + entry.period;
+    s.changes++;
+    s.sent++;
+  } else if ( !s.sending ) {
+    if ( (unsigned long)late > s.maxLate ) {
+      s.maxLate = (late > 0xffff)?0xffff:late;
+    }
+    s.nextDue += entry.period;
+    while ( (long)(now - s.nextDue) >= 0 ) {
+      s.nextDue += entry.period;
+      s.missed++;
+    }
+    s.sent++;
+  }
+  s.sending = !entry.send();
+}
+
+void TxScheduler::dumpStatus() {
+  TxScheduleEntry entry;
+  for (uint8_t i = 0; i < nEntries; i++) {
+    memcpy_P(&entry, &entries[i], sizeof(TxScheduleEntry));
+    Serial.print(F("Tx "));
+    Serial.print(entry.pgn);
+    Serial.print(F(" period:"));
+    Serial.print(entry.period);
+    Serial.print(F(" sent:"));
+    Serial.print(state[i].sent);
+    Serial.print(F(" maxLate:"));
+    Serial.print(state[i].maxLate);
+    Serial.print(F(" missed:"));
+    Serial.print(state[i].missed);
+    Serial.print(F(" changes:"));
+    Serial.println(state[i].changes);
+  }
+}
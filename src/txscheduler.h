@@ -0,0 +1,57 @@
+#pragma once
+#include <Arduino.h>
+
+// Entries start TX_SCHEDULER_SLOT ms apart, so entries with the same period stay apart.
+#define TX_SCHEDULER_SLOT 20
+#define TX_SCHEDULER_MAX_ENTRIES 8
+
+// Sends one message, returns false if there are more to send in this period.
+typedef bool (*TxSender)();
+// Returns true when the values sent have changed enough to send before the period.
+typedef bool (*TxChanged)();
+
+/**
+ * A PGN sent every period ms by send, held in PROGMEM.
+ * Table order is priority order, the first entry is the highest priority.
+ * With changed, period is a heartbeat and the entry is also sent as soon as changed
+ * returns true, but no more often than minPeriod.
+ */
+struct TxScheduleEntry {
+    unsigned long pgn;  // for the status, send may send more than one message
+    uint16_t period;
+    TxSender send;
+    uint16_t minPeriod;
+    TxChanged changed;  // NULL sends every period
+};
+
+struct TxScheduleState {
+    unsigned long nextDue = 0;
+    uint16_t maxLate = 0;   // ms, the worst jitter
+    uint16_t missed = 0;    // deadlines passed without a send, a send a whole period late
+    uint16_t sent = 0;
+    uint16_t changes = 0;   // sends before the period on a change
+    bool sending = false;   // the sender has more messages to send in this period
+};
+
+/**
+ * Table driven transmit scheduler.
+ * Holds the next due time of every entry and sends one message of the highest priority
+ * due entry per call, so transmissions spread over loop iterations rather than bursting.
+ * A sender with several messages sends one per call, so a burst of lower priority
+ * messages delays a higher priority one by at most one message.
+ * Due times advance by the period from the deadline, not from the send, so the slots
+ * do not drift. Adding a PGN is a table entry.
+ */
+class TxScheduler {
+public:
+    TxScheduler(const TxScheduleEntry *entries, uint8_t nEntries) :
+        entries(entries),
+        nEntries(nEntries) {};
+    void begin();
+    void run();
+    void dumpStatus();
+private:
+    const TxScheduleEntry *entries; // PROGMEM
+    uint8_t nEntries;
+    TxScheduleState state[TX_SCHEDULER_MAX_ENTRIES];
+};
@@ -0,0 +1,27 @@
+#pragma once
+// Minimal host stand in for the Arduino core, enough to compile the pure conversion
+// code in lib/enginesensors with g++. PROGMEM is ordinary memory on the host.
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+#define PROGMEM
+#define F(x) (x)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define pgm_read_ptr(p) (*(void * const *)(p))
+#define memcpy_P memcpy
+#define HEX 16
+
+class HostSerial {
+public:
+    template<class T> size_t print(T, int = 10) { return 0; }
+    template<class T> size_t println(T, int = 10) { return 0; }
+    size_t println() { return 0; }
+};
+extern HostSerial Serial;
+unsigned long millis();
+unsigned long micros();
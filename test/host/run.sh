@@ -0,0 +1,10 @@
+#!/bin/sh
+# Builds and runs the host tests of lib/enginesensors with g++, from the repository root.
+# The tests are plain programs against a minimal Arduino.h, not PlatformIO unit tests.
+set -e
+out=${TMPDIR:-/tmp}/n2kengine_host_tests
+mkdir -p "$out"
+g++ -std=gnu++11 -Wall -Itest/host -Ilib/enginesensors \
+    test/host/test_interpolate.cpp lib/enginesensors/interpolate.cpp \
+    -o "$out/test_interpolate"
+"$out/test_interpolate"
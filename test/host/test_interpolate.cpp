@@ -0,0 +1,96 @@
+/**
+ * Host test of EngineSensors::interpolate (lib/enginesensors/interpolate.cpp) with the
+ * curve tables generated at compile time by curves.h, against the linear scan and divide
+ * it replaced, run on the spreadsheet tables it was originally given.
+ *
+ * Covers every 12 bit ADC code, every fine reading (ADC_FINE_BITS) and every positive
+ * int16 reading, as ratiometric coolant readings are scaled to a 12V supply and go above
+ * the fine range. The reciprocal is rounded where the divide truncated, so 1 count (0.1C)
+ * is allowed.
+ *
+ * Build and run from the repository root with test/host/run.sh.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "curves.h"
+
+HostSerial Serial;
+unsigned long millis() { return 0; }
+unsigned long micros() { return 0; }
+
+// Spreadsheet tables at 4096 resolution, as in enginesensors.cpp before the curves were generated.
+const int16_t coolantTable[] = {
+  5095, 3969, 2999, 2216, 1618, 1162, 869, 643, 477, 360, 277, 212
+};
+const int16_t tcurveNMF5210K[] = {
+  3921, 3863, 3790, 3701, 3594, 3467, 3322, 3159, 2979, 2786,
+  2585, 2378, 2171, 1968, 1773, 1589, 1417, 1259, 1116, 987,
+  872, 769, 679, 599, 529, 468, 414, 368, 326, 291,
+  259, 231, 207, 186
+};
+
+/**
+ * The original EngineSensors::interpolate, a linear scan and a divide, with the table
+ * scaled to fine readings and the arithmetic in 32 bits so it is exact on the host.
+ */
+int16_t scanInterpolate(int32_t reading, int16_t minCurveValue, int16_t maxCurveValue,
+      int step, const int16_t *curve, int curveLength) {
+  int32_t cvp = ((int32_t)curve[0])<<ADC_FINE_SHIFT;
+  if ( reading > cvp ) {
+    return minCurveValue;
+  }
+  for (int i = 1; i < curveLength; i++) {
+    int32_t cv = ((int32_t)curve[i])<<ADC_FINE_SHIFT;
+    if ( reading > cv ) {
+      return minCurveValue+((i-1)*step)+((cvp-reading)*step)/(cvp-cv);
+    }
+    cvp = cv;
+  }
+  return maxCurveValue;
+}
+
+struct TestCurve {
+  const char *name;
+  ConversionCurve curve;
+  const int16_t *original;
+};
+
+bool check(const TestCurve &c, const char *label, int32_t from, int32_t to, int32_t increment) {
+  int16_t min = c.curve.min;
+  int16_t max = c.curve.min+(c.curve.length-1)*c.curve.step;
+  int worst = 0;
+  int32_t worstReading = 0;
+  for (int32_t reading = from; reading <= to; reading += increment) {
+    int16_t expected = scanInterpolate(reading, min, max, c.curve.step, c.original, c.curve.length);
+    int16_t actual = EngineSensors::interpolate((int16_t)reading, &c.curve);
+    if ( abs(actual-expected) > worst ) {
+      worst = abs(actual-expected);
+      worstReading = reading;
+    }
+  }
+  printf("%-9s %-14s max error %d x0.1C at %ld\n", c.name, label, worst, (long)worstReading);
+  return worst <= 1;
+}
+
+int main() {
+  const TestCurve curves[] = {
+    { "coolant", { coolantTables.table, coolantTables.reciprocal, coolantTables.index,
+        vpCoolant.min, vpCoolant.step, vpCoolant.points }, coolantTable },
+    { "NMF5210K", { NMF5210KTables.table, NMF5210KTables.reciprocal, NMF5210KTables.index,
+        mt52_10K.min, mt52_10K.step, mt52_10K.points }, tcurveNMF5210K },
+  };
+  bool ok = true;
+  for (const TestCurve &c : curves) {
+    for (uint8_t i = 0; i < c.curve.length; i++) {
+      if ( c.curve.table[i] != c.original[i] ) {
+        printf("%-9s point %d generated %d spreadsheet %d\n", c.name, i, c.curve.table[i], c.original[i]);
+        ok = false;
+      }
+    }
+    ok = check(c, "4096 codes", 0, 4095L<<ADC_FINE_SHIFT, 1L<<ADC_FINE_SHIFT) && ok;
+    ok = check(c, "fine readings", 0, (1L<<ADC_FINE_BITS)-1, 1) && ok;
+    ok = check(c, "int16 readings", 0, INT16_MAX, 1) && ok;
+  }
+  printf("%s\n", ok?"PASS":"FAIL");
+  return ok?0:1;
+}
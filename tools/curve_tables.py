@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""
+Checks the thermistor curves generated at compile time by
+lib/enginesensors/thermistor.h and curves.h, by computing them the same way.
+
+Each curve is a list of ADC readings at 4096 resolution, falling as the
+temperature rises, one reading every step 0.1C from min, computed from the
+sensor (B parameter or data sheet resistances) and its divider.
+thermistor.h also computes per curve:
+  reciprocal  per segment step*2^16/width, width being the segment in fine
+              readings (ADC_FINE_BITS), so a reading converts with one multiply
+              and a shift rather than a divide.
+  index       per coarse bucket of the fine reading (top INDEX_BITS bits), the
+              segment containing the highest reading in the bucket. A reading
+              finds its segment from the index with at most a few steps forward.
+and optionally (NTC_DIRECT_LOOKUP) a direct lookup of a B parameter NTC.
+
+This is a self-check of the generator, the firmware conversion itself is tested
+on the host against the original linear scan by test/host/test_interpolate.cpp.
+The check compares:
+  - the computed readings with the spreadsheet tables they replaced.
+  - the index with the segment of every fine reading in its bucket, the index must
+    never be past the segment, and reports the steps forward needed.
+  - the direct lookup with the interpolated curve.
+
+Keep the parameters here in step with curves.h.
+
+Usage:
+  tools/curve_tables.py [--lookup-bits 12]
+"""
+
+from __future__ import annotations
+
+import argparse
+import math
+import sys
+
+FINE_BITS = 14
+FINE_SHIFT = FINE_BITS - 12
+INDEX_BITS = 6
+INDEX_SHIFT = FINE_BITS - INDEX_BITS
+RECIPROCAL_BITS = 16
+
+# Volvo Penta standard coolant sensor, 1000R top, 12V supply, 10C to 120C.
+COOLANT = dict(
+    name="coolant",
+    min=100,
+    step=100,
+    b=0,
+    resistances=[1076, 677, 439, 291, 197, 134, 97, 70, 51, 38, 29, 22],
+    r_top=1000, supply=12.0, v_ref=5.0,
+    spreadsheet=[5095, 3969, 2999, 2216, 1618, 1162, 869, 643, 477, 360, 277, 212],
+)
+
+# MT52-10K, B=3950, 4700R top, 5V supply, -20C to 145C.
+NMF5210K = dict(
+    name="NMF5210K",
+    min=-200,
+    step=50,
+    b=3950, r0=10000, t0=298.15,
+    r_top=4700, supply=5.0, v_ref=5.0,
+    spreadsheet=[3921, 3863, 3790, 3701, 3594, 3467, 3322, 3159, 2979, 2786,
+                 2585, 2378, 2171, 1968, 1773, 1589, 1417, 1259, 1116, 987,
+                 872, 769, 679, 599, 529, 468, 414, 368, 326, 291,
+                 259, 231, 207, 186],
+)
+
+CURVES = [COOLANT, NMF5210K]
+
+
+def resistance(curve, i):
+    if curve["b"] == 0:
+        return curve["resistances"][i]
+    t = 273.15 + 0.1*(curve["min"] + curve["step"]*i)
+    return curve["r0"]*math.exp(curve["b"]*(1.0/t - 1.0/curve["t0"]))
+
+
+def table(curve):
+    """thermistor::adc for each point."""
+    out = []
+    for i in range(len(curve["spreadsheet"])):
+        r = resistance(curve, i)
+        out.append(int(4096.0*curve["supply"]/curve["v_ref"]*r/(r + curve["r_top"]) + 0.5))
+    return out
+
+
+def reciprocals(curve):
+    """thermistor::reciprocal, segment s covers fine readings (t[s], t[s-1]]."""
+    t = curve["table"]
+    r = [0]
+    for s in range(1, len(t)):
+        width = (t[s-1] - t[s]) << FINE_SHIFT
+        r.append((curve["step"] * (1 << RECIPROCAL_BITS) + width // 2) // width)
+    if max(r) > 0xffff:
+        raise ValueError("%s reciprocal overflows uint16" % curve["name"])
+    return r
+
+
+def segment(curve, reading):
+    """Segment of a fine reading, 0 above the curve, len(table) below it."""
+    t = curve["table"]
+    for s in range(len(t)):
+        if reading > (t[s] << FINE_SHIFT):
+            return s
+    return len(t)
+
+
+def index(curve):
+    return [segment(curve, (b << INDEX_SHIFT) | ((1 << INDEX_SHIFT) - 1))
+            for b in range(1 << INDEX_BITS)]
+
+
+def original(curve, reading):
+    """The curve, as the linear scan and divide EngineSensors::interpolate replaced."""
+    t = curve["table"]
+    cvp = t[0] << FINE_SHIFT
+    if reading > cvp:
+        return curve["min"]
+    for i in range(1, len(t)):
+        cv = t[i] << FINE_SHIFT
+        if reading > cv:
+            # C integer division truncates towards 0, operands are +ve.
+            return curve["min"] + (i-1)*curve["step"] + ((cvp-reading)*curve["step"])//(cvp-cv)
+        cvp = cv
+    return curve["min"] + (len(t)-1)*curve["step"]
+
+
+def lookup(curve, code, bits):
+    """thermistor::lookup, 0.1C from the B parameter model."""
+    n = len(curve["table"])
+    cmax = curve["min"] + curve["step"]*(n-1)
+    if code <= 0:
+        return cmax
+    if code >= (1 << bits):
+        return curve["min"]
+    r = curve["r_top"]*code/((1 << bits)*curve["supply"]/curve["v_ref"] - code)
+    k = 1.0/(1.0/curve["t0"] + math.log(r/curve["r0"])/curve["b"])
+    deci_c = 10.0*(k - 273.15)
+    if deci_c < curve["min"]:
+        return curve["min"]
+    if deci_c > cmax:
+        return cmax
+    return int(deci_c - 0.5) if deci_c < 0 else int(deci_c + 0.5)
+
+
+def looked_up(curve, reading, lut, bits):
+    """EngineSensors::convertNTC with NTC_DIRECT_LOOKUP."""
+    shift = FINE_BITS - bits
+    i = reading >> shift
+    return lut[i] + (((lut[i+1] - lut[i])*(reading & ((1 << shift) - 1))) >> shift)
+
+
+def check(lookup_bits):
+    ok = True
+    for curve in CURVES:
+        curve["table"] = table(curve)
+        differences = [i for i, (a, b) in enumerate(zip(curve["table"], curve["spreadsheet"])) if a != b]
+        print("%-9s %d points, %d differ from the spreadsheet %s"
+              % (curve["name"], len(curve["table"]), len(differences), differences))
+        if differences:
+            ok = False
+        idx = index(curve)
+        reciprocals(curve)
+        max_steps = 0
+        behind = 0
+        for reading in range(1 << FINE_BITS):
+            steps = segment(curve, reading) - idx[reading >> INDEX_SHIFT]
+            if steps < 0:
+                behind += 1
+            max_steps = max(max_steps, steps)
+        print("%-9s index max steps %d, %d readings with the index past their segment"
+              % (curve["name"], max_steps, behind))
+        if behind:
+            ok = False
+        if curve["b"] != 0:
+            lut = [lookup(curve, code, lookup_bits) for code in range((1 << lookup_bits) + 1)]
+            worst = 0
+            worst_reading = 0
+            # within the curve, outside it both clamp.
+            lowest = curve["table"][-1] << FINE_SHIFT
+            highest = curve["table"][0] << FINE_SHIFT
+            for reading in range(lowest, highest):
+                d = abs(looked_up(curve, reading, lut, lookup_bits) - original(curve, reading))
+                if d > worst:
+                    worst = d
+                    worst_reading = reading
+            print("%-9s direct lookup %d bits, %d bytes, max difference from the curve %d x0.1C at %d"
+                  % (curve["name"], lookup_bits, 2*len(lut), worst, worst_reading))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--lookup-bits", type=int, default=12, help="NTC_DIRECT_LOOKUP_BITS")
+    args = parser.parse_args()
+    return 0 if check(args.lookup_bits) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,355 @@
+#!/usr/bin/env python3
+"""
+Host simulation of the flywheel frequency backends (FREQENCY_METHOD_x), run
+against the same synthetic pulse trains so they can be compared on accuracy,
+jitter and CPU cost before flashing.
+
+The backends here are Python models written from the firmware, not the firmware
+itself compiled for the host. The figures compare the designs as modelled, they
+are not a measurement of readFrequencyCapture or its ISRs, and nothing checks the
+models against the firmware. A change to a backend needs the same change here.
+
+Each backend models its readFrequencyCapture in lib/enginesensors:
+  0  defaultSensors.cpp      pin ISR per edge, micros() (4us) every 100 edges.
+  1  attiny3226sensors.cpp   TCB0 frequency capture of single periods at
+                             16MHz, ISR per edge, last 4 reads averaged.
+  2  attiny3226sensors2.cpp  pin ISR per edge, adaptive gate (RPM_GATE_*)
+                             timed with 32 bit TCA0 timestamps at 250KHz,
+                             edges qualified against the expected tooth
+                             period (RPM_EDGE_QUALIFY_SHIFT).
+  3  attiny3226sensors3.cpp  as 2, edges counted by TCB0 from the event
+                             system through the CCL filter (2-3 OSC32K
+                             clocks), ISR per gate.
+Reads happen every DEFAULT_FLYWHEEL_READ_PERIOD (100ms). Software timestamps
+(0, 2 and 3 read the timer in an ISR) are delayed by a random ISR latency.
+Frequencies are reported as RPM (Hz * RPM_FACTOR, 30 teeth).
+
+Pulse trains:
+  steady      constant RPM with per tooth jitter and firing pulsation.
+  cranking    150 RPM with strong pulsation.
+  ramp        800 to 3000 RPM over 2s and back.
+  stop        2000 RPM then the engine stops instantly. The gated methods
+              report the last capture for up to RPM_GATE_MAX_TICKS (1s)
+              after the edges stop, see enginesensors.h, which shows as
+              error here.
+
+Per scenario and backend the report gives the mean and standard deviation of
+the error against the true RPM at the time of each read, the worst error,
+the fraction of reads with a measurement, and ISR calls per second, excluding
+the first --settle seconds while the backends fill.
+
+--glitches adds spurious edges from the comparator at random, a few us wide,
+which only the CCL filter sees and so can discard; the ISR methods see each.
+
+Keep the constants here in step with enginesensors.h.
+
+Usage:
+  tools/frequency_sim.py [--rpm 2000] [--seconds 10] [--jitter 0.2]
+                         [--pulsation 1.0] [--isr-latency-us 8] [--settle 0.5]
+                         [--glitches 0] [--seed 1]
+"""
+
+from __future__ import annotations
+
+import argparse
+import math
+import random
+import statistics
+import sys
+
+TEETH = 30
+RPM_FACTOR = 2.0
+READ_PERIOD = 0.1
+TCA0_HZ = 250000.0
+TCB_HZ = 16000000.0
+MICROS_RESOLUTION = 4e-6
+RPM_GATE_TARGET_TICKS = 12500
+RPM_GATE_MIN_EDGES = 2
+RPM_GATE_MAX_EDGES = 128
+RPM_GATE_INITIAL_EDGES = 16
+RPM_GATE_MAX_TICKS = 250000
+RPM_EDGE_QUALIFY_SHIFT = 1
+RPM_EDGE_QUALIFY_MAX_TICKS = 0x4000
+CCL_CLOCK_HZ = 32768.0
+
+
+def pulse_train(rpm_at, seconds, jitter, pulsation, rng):
+    """Edge times for a speed profile rpm_at(t). pulsation is the % speed variation
+    at twice per revolution (4 cylinder 4 stroke), jitter the % random tooth error."""
+    edges = []
+    t = 0.0
+    angle = 0.0
+    while t < seconds:
+        rpm = rpm_at(t)
+        if rpm <= 0:
+            t += 0.01
+            continue
+        speed = rpm*(1.0 + 0.01*pulsation*math.sin(2.0*angle))
+        period = 60.0/(speed*TEETH)
+        period *= 1.0 + 0.01*jitter*rng.gauss(0, 1)
+        t += period
+        angle += 2.0*math.pi/TEETH
+        edges.append(t)
+    return edges
+
+
+def ticks(t, hz):
+    return int(t*hz)
+
+
+class Backend:
+    name = ""
+    timer_overflow_isr = False  # TCA0 overflow ISR, 3.8/s
+
+    def __init__(self, latency, rng):
+        self.latency = latency
+        self.rng = rng
+        self.isr_calls = 0
+
+    def isr_delay(self):
+        return self.rng.uniform(0, self.latency)
+
+    def edge(self, t):
+        pass
+
+    def glitch(self, t):
+        """a spurious edge, by default seen as an edge"""
+        self.edge(t)
+
+    def read(self, t):
+        """returns (Hz, confidence)"""
+        return 0.0, 0
+
+
+class Method0(Backend):
+    name = "0 micros/100 edges"
+
+    def __init__(self, latency, rng):
+        super().__init__(latency, rng)
+        self.count = 0
+        self.last = 0.0
+        self.this = 0.0
+        self.prev_this = 0.0
+
+    def edge(self, t):
+        self.isr_calls += 1
+        self.count += 1
+        if self.count == 100:
+            self.last = self.this
+            self.this = math.floor((t + self.isr_delay())/MICROS_RESOLUTION)*MICROS_RESOLUTION
+            self.count = 0
+
+    def read(self, t):
+        period = self.this - self.last
+        f = 0.0
+        if period > 0 and t - self.this < 1.0:
+            f = 100.0/period
+        if f < 200 or f > 4000:
+            return 0.0, 0
+        c = 100 if self.this != self.prev_this else 50
+        self.prev_this = self.this
+        return f, c
+
+
+class Method1(Backend):
+    name = "1 TCB period x4"
+
+    def __init__(self, latency, rng):
+        super().__init__(latency, rng)
+        self.capture = 0
+        self.previous_edge = None
+        self.last_count = 0
+        self.smoothed = [0, 0, 0, 0]
+        self.slot = 0
+
+    def edge(self, t):
+        self.isr_calls += 1
+        if self.previous_edge is not None:
+            # 16 bit TCB at CLK_PER, wraps after 4ms
+            self.capture = ticks(t - self.previous_edge, TCB_HZ) & 0xffff
+        self.previous_edge = t
+
+    def read(self, t):
+        n = self.isr_calls - self.last_count
+        f = 0
+        if n > 10:
+            self.last_count = self.isr_calls
+            if self.capture > 4000:
+                f = 160000000//self.capture
+        self.smoothed[self.slot & 3] = f
+        self.slot += 1
+        measured = sum(1 for s in self.smoothed if s > 0)
+        return sum(self.smoothed)/40.0, measured*25
+
+
+class Method2(Backend):
+    name = "2 pin ISR, gate"
+    timer_overflow_isr = True
+
+    def __init__(self, latency, rng):
+        super().__init__(latency, rng)
+        self.edges = 0
+        self.gate = RPM_GATE_INITIAL_EDGES
+        self.times = [0, 0]
+        self.gates = [0, 0]
+        self.slot = 0
+        self.captured_slot = 0
+        self.captures = 0
+        self.last_captures = 0
+        self.last_edge = 0
+        self.min_edge_ticks = 0
+        self.stopped = False
+
+    def adapt(self, period):
+        if period > 2*RPM_GATE_TARGET_TICKS and self.gate > RPM_GATE_MIN_EDGES:
+            self.gate >>= 1
+        elif period < RPM_GATE_TARGET_TICKS//2 and self.gate < RPM_GATE_MAX_EDGES:
+            self.gate <<= 1
+
+    def capture(self, t, edges):
+        stamp = ticks(t + self.isr_delay(), TCA0_HZ)
+        period = stamp - self.times[self.captured_slot]
+        self.times[self.slot] = stamp
+        self.gates[self.slot] = edges
+        self.captured_slot = self.slot
+        self.slot ^= 1
+        self.captures += 1
+        self.adapt(period)
+        return period
+
+    def edge(self, t):
+        self.isr_calls += 1
+        count = ticks(t + self.isr_delay(), TCA0_HZ) & 0xffff
+        if (count - self.last_edge) & 0xffff < self.min_edge_ticks:
+            return
+        self.last_edge = count
+        self.edges += 1
+        if self.edges >= self.gate:
+            period = self.capture(t, self.edges)
+            tooth = period//self.edges
+            self.min_edge_ticks = tooth >> RPM_EDGE_QUALIFY_SHIFT if tooth < RPM_EDGE_QUALIFY_MAX_TICKS else 0
+            self.edges = 0
+
+    def read(self, t):
+        l = self.captured_slot
+        p = l ^ 1
+        period = self.times[l] - self.times[p]
+        age = ticks(t, TCA0_HZ) - self.times[l]
+        gate = self.gates[l]
+        f, c = 0.0, 0
+        if age < RPM_GATE_MAX_TICKS and period > 60*gate and period < RPM_GATE_MAX_TICKS:
+            f = gate*TCA0_HZ/period
+            c = 100 if self.captures != self.last_captures else 50
+        self.last_captures = self.captures
+        stopped = age >= RPM_GATE_MAX_TICKS
+        if stopped and not self.stopped:
+            self.clear_qualifier(t)
+        self.stopped = stopped
+        return f, c
+
+    def clear_qualifier(self, t):
+        """once on a gate timeout, as readFrequencyCapture"""
+        self.min_edge_ticks = 0
+        self.edges = 0
+        self.last_edge = ticks(t, TCA0_HZ) & 0xffff
+
+
+class Method3(Method2):
+    name = "3 TCB count, gate"
+
+    def edge(self, t):
+        # filtered and counted in hardware, the ISR runs once per gate.
+        t += self.rng.uniform(2, 3)/CCL_CLOCK_HZ
+        self.edges += 1
+        if self.edges >= self.gate:
+            self.isr_calls += 1
+            self.capture(t, self.edges)
+            self.edges = 0
+
+    def glitch(self, t):
+        pass
+
+    def clear_qualifier(self, t):
+        # TCB0 counts in hardware, there is no qualifier.
+        pass
+
+
+BACKENDS = [Method0, Method1, Method2, Method3]
+
+
+def scenarios(rpm):
+    return [
+        ("steady %d" % rpm, lambda t: rpm),
+        ("cranking 150", lambda t: 150),
+        ("ramp 800-3000", lambda t: 800 + 2200*min(1.0, t/2.0) if t < 5 else 3000 - 2200*min(1.0, (t-5)/2.0)),
+        ("stop from 2000", lambda t: 2000 if t < 3 else 0),
+    ]
+
+
+def glitch_train(rate, seconds, rng):
+    glitches = []
+    t = 0.0
+    while rate > 0:
+        t += rng.expovariate(rate)
+        if t >= seconds:
+            break
+        glitches.append(t)
+    return glitches
+
+
+def simulate(backend, edges, glitches, rpm_at, seconds, settle):
+    errors = []
+    measured = 0
+    reads = 0
+    i = 0
+    g = 0
+    t = READ_PERIOD
+    while t < seconds:
+        while (i < len(edges) and edges[i] <= t) or (g < len(glitches) and glitches[g] <= t):
+            if g < len(glitches) and (i >= len(edges) or glitches[g] < edges[i]):
+                backend.glitch(glitches[g])
+                g += 1
+            else:
+                backend.edge(edges[i])
+                i += 1
+        f, confidence = backend.read(t)
+        if t >= settle:
+            reads += 1
+            if confidence > 0:
+                measured += 1
+            errors.append(f*RPM_FACTOR - rpm_at(t))
+        t += READ_PERIOD
+    isr_rate = backend.isr_calls/seconds
+    if backend.timer_overflow_isr:
+        isr_rate += TCA0_HZ/65536
+    return errors, measured/reads, isr_rate
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rpm", type=float, default=2000, help="steady scenario RPM")
+    parser.add_argument("--seconds", type=float, default=10, help="length of each pulse train")
+    parser.add_argument("--jitter", type=float, default=0.2, help="random tooth period error, %%")
+    parser.add_argument("--pulsation", type=float, default=1.0, help="firing speed variation, %%")
+    parser.add_argument("--isr-latency-us", type=float, default=8, help="max ISR latency for software timestamps")
+    parser.add_argument("--settle", type=float, default=0.5, help="seconds at the start excluded from the report")
+    parser.add_argument("--glitches", type=float, default=0, help="spurious edges per second")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print("%-16s %-20s %9s %9s %9s %7s %9s" % ("scenario", "backend", "mean err", "jitter", "worst", "valid", "isr/s"))
+    for name, rpm_at in scenarios(args.rpm):
+        pulsation = args.pulsation*5 if name.startswith("cranking") else args.pulsation
+        edges = pulse_train(rpm_at, args.seconds, args.jitter, pulsation, random.Random(args.seed))
+        glitches = glitch_train(args.glitches, args.seconds, random.Random(args.seed + 1))
+        for backend_class in BACKENDS:
+            backend = backend_class(args.isr_latency_us*1e-6, random.Random(args.seed))
+            errors, valid, isr_rate = simulate(backend, edges, glitches, rpm_at, args.seconds, args.settle)
+            print("%-16s %-20s %9.2f %9.2f %9.1f %6.0f%% %9.0f" % (
+                name, backend.name, statistics.mean(errors), statistics.pstdev(errors),
+                max(errors, key=abs), 100.0*valid, isr_rate))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())